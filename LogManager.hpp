@@ -207,6 +207,10 @@ public:
     bool isRecoverNeeded(void) {
         return log_->isRecoverNeeded();
     }
+
+    const io_stats & getIoStats(void) const {
+        return log_->getStats();
+    }
 private:
   LogFileBackingStore *log_;
   swap_space *ss_;
@@ -3,20 +3,166 @@
 #include <iostream>
 #include <ext/stdio_filebuf.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+//////////////////////////////////////////////////////
+// Default whole-object transfers for backing_store //
+//////////////////////////////////////////////////////
+void backing_store::read(uint64_t obj_id, uint64_t version, std::string &buf)
+{
+  std::iostream *in = get(obj_id, version);
+  std::stringstream sstream;
+  sstream << in->rdbuf();
+  buf = sstream.str();
+  put(in);
+}
+
+void backing_store::write(uint64_t obj_id, uint64_t version,
+                          const char *buf, size_t len)
+{
+  std::iostream *out = get(obj_id, version);
+  out->write(buf, len);
+  put(out);
+}
+
+void backing_store::write_batch(std::vector<batch_write> &batch)
+{
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    allocate(it->obj_id, it->version);
+    write(it->obj_id, it->version, it->buf, it->len);
+  }
+}
+
+///////////////////////////////////////////
+// Implementation of aligned_buffer_pool //
+///////////////////////////////////////////
+aligned_buffer_pool::aligned_buffer_pool(size_t alignment,
+                                         size_t max_free_per_bucket)
+  : alignment(alignment),
+    max_free_per_bucket(max_free_per_bucket)
+{}
+
+aligned_buffer_pool::~aligned_buffer_pool(void)
+{
+  for (auto it = free_buffers.begin(); it != free_buffers.end(); ++it)
+    for (auto bit = it->second.begin(); bit != it->second.end(); ++bit)
+      free(*bit);
+}
+
+//hand out a buffer of at least len bytes.  capacity is rounded up to a
+//power of two (and at least one alignment unit) so buffers can be reused
+//across nodes of similar size.
+char * aligned_buffer_pool::acquire(size_t len, size_t &capacity)
+{
+  capacity = alignment;
+  while (capacity < len)
+    capacity <<= 1;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<char *> &bucket = free_buffers[capacity];
+    if (!bucket.empty()) {
+      char *buf = bucket.back();
+      bucket.pop_back();
+      return buf;
+    }
+  }
+  void *buf = NULL;
+  int r = posix_memalign(&buf, alignment, capacity);
+  assert(r == 0 && buf != NULL);
+  return (char *)buf;
+}
+
+void aligned_buffer_pool::release(char *buf, size_t capacity)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<char *> &bucket = free_buffers[capacity];
+  if (bucket.size() < max_free_per_bucket)
+    bucket.push_back(buf);
+  else
+    free(buf);
+}
 
 /////////////////////////////////////////////////////////////
 // Implementation of the one_file_per_object_backing_store //
 /////////////////////////////////////////////////////////////
-one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt)
-  : root(rt)
-{}
+//Not every filesystem supports O_DIRECT (e.g. tmpfs), so find out up
+//front whether root does, and use buffered I/O for good if not.
+one_file_per_object_backing_store::one_file_per_object_backing_store(std::string rt,
+                                                                     bool direct_io)
+  : root(rt),
+    direct_io(direct_io),
+    buffers(4096)
+{
+  if (!direct_io)
+    return;
+  std::string probe = root + "/.o_direct_probe";
+  int fd = open(probe.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+  if (fd >= 0) {
+    close(fd);
+    unlink(probe.c_str());
+  } else if (errno == EINVAL) {
+    debug(std::cout << "O_DIRECT not supported under " << root
+          << ", using buffered I/O" << std::endl);
+    this->direct_io = false;
+  }
+}
+
+//a system call on a node file failed.  Node data cannot be trusted past
+//this point, so stop, even in builds without asserts.
+static void node_io_failed(const char *call, const std::string &filename,
+                           const char *why)
+{
+  std::cerr << call << " " << filename << ": " << why << std::endl;
+  abort();
+}
+
+//pread from offset 0 until at least len bytes are in buf, asking for up
+//to room bytes in all.  Retries calls cut short by a signal.
+static void pread_fully(int fd, const std::string &filename, char *buf,
+                        size_t len, size_t room)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, room - done, done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      node_io_failed("pread", filename,
+                     n == 0 ? "unexpected end of file" : strerror(errno));
+    done += n;
+  }
+}
+
+//pwrite all len bytes of buf at offset 0.  Retries calls cut short by a
+//signal.
+static void pwrite_fully(int fd, const std::string &filename,
+                         const char *buf, size_t len)
+{
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      node_io_failed("pwrite", filename,
+                     n == 0 ? "no progress" : strerror(errno));
+    done += n;
+  }
+}
 
 //allocate space for a new version of an object
 //requires that version be >> any previous version
 //logic for this is now handled by the swap space
 void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t version) {
   //uint64_t id = nextid++;
+  io_timer timer(stats, io_stats::FILE_CREATE);
   std::string filename = get_filename(obj_id, version);
   std::fstream dummy(filename, std::fstream::out);
   debug(std::cout << "filename:" << filename << std::endl);
@@ -27,6 +173,7 @@ void one_file_per_object_backing_store::allocate(uint64_t obj_id, uint64_t versi
 
 //delete the file associated with an specific version of a node
 void one_file_per_object_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
+  io_timer timer(stats, io_stats::FILE_UNLINK);
   std::string filename = get_filename(obj_id, version);
   assert(unlink(filename.c_str()) == 0);
 }
@@ -51,11 +198,130 @@ void one_file_per_object_backing_store::put(std::iostream *ios)
 {
   ios->flush();
   __gnu_cxx::stdio_filebuf<char> *fb = (__gnu_cxx::stdio_filebuf<char> *)ios->rdbuf();
-  fsync(fb->fd());
+  {
+    io_timer timer(stats, io_stats::FSYNC);
+    fsync(fb->fd());
+  }
   delete ios;
   delete fb;
 }
 
+//open a node file, using O_DIRECT when direct I/O is enabled.
+int one_file_per_object_backing_store::open_node_file(const std::string &filename,
+                                                      int flags)
+{
+  int fd = open(filename.c_str(), flags | (direct_io ? O_DIRECT : 0), 0666);
+  if (fd < 0)
+    node_io_failed("open", filename, strerror(errno));
+  return fd;
+}
+
+//read a whole version of an object into buf.
+void one_file_per_object_backing_store::read(uint64_t obj_id, uint64_t version,
+                                             std::string &buf)
+{
+  io_timer timer(stats, io_stats::NODE_READ);
+  std::string filename = get_filename(obj_id, version);
+  int fd = open_node_file(filename, O_RDONLY);
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+    node_io_failed("fstat", filename, strerror(errno));
+  size_t len = st.st_size;
+  timer.set_bytes(len);
+
+  if (direct_io) {
+    // O_DIRECT transfers must be block-aligned in address, offset and
+    // length.  The read stops short at EOF, which is fine.
+    size_t alignment = buffers.get_alignment();
+    size_t padded = (len + alignment - 1) / alignment * alignment;
+    size_t capacity;
+    char *abuf = buffers.acquire(padded, capacity);
+    pread_fully(fd, filename, abuf, len, padded);
+    buf.assign(abuf, len);
+    buffers.release(abuf, capacity);
+  } else {
+    buf.resize(len);
+    pread_fully(fd, filename, &buf[0], len, len);
+  }
+  close(fd);
+}
+
+//write a whole version of an object and make it durable.
+void one_file_per_object_backing_store::write(uint64_t obj_id, uint64_t version,
+                                              const char *buf, size_t len)
+{
+  std::string filename = get_filename(obj_id, version);
+  int fd = open_node_file(filename, O_WRONLY | O_TRUNC);
+  {
+    io_timer timer(stats, io_stats::NODE_WRITE, len);
+    write_file(fd, filename, buf, len);
+  }
+  sync_file(fd, filename);
+  close(fd);
+}
+
+//create and write every version in the batch and make them all durable:
+//each file is fsync()ed before it is closed, and the directory once at
+//the end, for the new entries.  Only our own files are synced, unlike
+//syncfs(), whose cost depends on whatever else is dirty on the disk.
+void one_file_per_object_backing_store::write_batch(std::vector<batch_write> &batch)
+{
+  if (batch.empty())
+    return;
+  for (auto it = batch.begin(); it != batch.end(); ++it) {
+    std::string filename = get_filename(it->obj_id, it->version);
+    int fd;
+    {
+      io_timer timer(stats, io_stats::FILE_CREATE);
+      fd = open_node_file(filename, O_WRONLY | O_CREAT | O_TRUNC);
+    }
+    {
+      io_timer timer(stats, io_stats::NODE_WRITE, it->len);
+      write_file(fd, filename, it->buf, it->len);
+    }
+    sync_file(fd, filename);
+    close(fd);
+  }
+  int dirfd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dirfd < 0)
+    node_io_failed("open", root, strerror(errno));
+  sync_file(dirfd, root);
+  close(dirfd);
+}
+
+//fsync() a node file or the directory.  The caller is about to switch
+//objects over to the versions written, so a failure must not go unseen.
+void one_file_per_object_backing_store::sync_file(int fd,
+                                                  const std::string &filename)
+{
+  io_timer timer(stats, io_stats::FSYNC);
+  if (fsync(fd) != 0)
+    node_io_failed("fsync", filename, strerror(errno));
+}
+
+//write len bytes at the start of an open node file, without syncing.
+void one_file_per_object_backing_store::write_file(int fd,
+                                                   const std::string &filename,
+                                                   const char *buf, size_t len)
+{
+  if (direct_io) {
+    // Pad the tail out to a whole block, then trim the file back to
+    // the real length.
+    size_t alignment = buffers.get_alignment();
+    size_t padded = (len + alignment - 1) / alignment * alignment;
+    size_t capacity;
+    char *abuf = buffers.acquire(padded, capacity);
+    memcpy(abuf, buf, len);
+    memset(abuf + len, 0, padded - len);
+    pwrite_fully(fd, filename, abuf, padded);
+    buffers.release(abuf, capacity);
+    if (ftruncate(fd, len) != 0)
+      node_io_failed("ftruncate", filename, strerror(errno));
+  } else {
+    pwrite_fully(fd, filename, buf, len);
+  }
+}
+
 
 //Given an object and version, return the filename corresponding to it.
 std::string one_file_per_object_backing_store::get_filename(uint64_t obj_id, uint64_t version){
@@ -68,6 +334,138 @@ std::string one_file_per_object_backing_store::getRootDir(void) {
   return root;
 }
 
+//////////////////////////////////////////////////
+// Implementation of the in_memory_backing_store //
+//////////////////////////////////////////////////
+in_memory_backing_store::in_memory_backing_store(std::string rt,
+                                                 uint64_t latency_us,
+                                                 uint64_t bytes_per_sec)
+  : latency_us(latency_us),
+    bytes_per_sec(bytes_per_sec)
+{
+  // The tree keeps its log under getRootDir().  Give it a fresh
+  // directory, so that it never finds, and tries to recover from, a
+  // log left in rt by an earlier run.
+  std::string path = rt + "/in_memory.XXXXXX";
+  char *made = mkdtemp(&path[0]);
+  assert(made != NULL);
+  root = path;
+}
+
+//the log is no more durable than the nodes, so remove it.
+in_memory_backing_store::~in_memory_backing_store(void) {
+  DIR *dir = opendir(root.c_str());
+  if (dir != NULL) {
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+      if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+        unlink((root + "/" + ent->d_name).c_str());
+    closedir(dir);
+  }
+  rmdir(root.c_str());
+}
+
+void in_memory_backing_store::allocate(uint64_t obj_id, uint64_t version) {
+  std::lock_guard<std::mutex> guard(lock);
+  versions[version_key(obj_id, version)] = std::string();
+}
+
+void in_memory_backing_store::deallocate(uint64_t obj_id, uint64_t version) {
+  std::lock_guard<std::mutex> guard(lock);
+  size_t erased = versions.erase(version_key(obj_id, version));
+  assert(erased == 1);
+}
+
+std::iostream * in_memory_backing_store::get(uint64_t obj_id, uint64_t version) {
+  version_key key(obj_id, version);
+  std::stringstream *ios;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(versions.count(key) > 0);
+    ios = new std::stringstream(versions[key]);
+    open_streams[ios] = key;
+  }
+  io_timer timer(stats, io_stats::NODE_READ, ios->str().size());
+  simulate_device(ios->str().size());
+  return ios;
+}
+
+void in_memory_backing_store::put(std::iostream *ios) {
+  std::stringstream *sstream = (std::stringstream *)ios;
+  size_t len;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(open_streams.count(ios) > 0);
+    std::string &data = versions[open_streams[ios]];
+    data = sstream->str();
+    len = data.size();
+    open_streams.erase(ios);
+  }
+  io_timer timer(stats, io_stats::NODE_WRITE, len);
+  simulate_device(len);
+  delete ios;
+}
+
+void in_memory_backing_store::read(uint64_t obj_id, uint64_t version,
+                                   std::string &buf) {
+  version_key key(obj_id, version);
+  io_timer timer(stats, io_stats::NODE_READ);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(versions.count(key) > 0);
+    buf = versions[key];
+  }
+  timer.set_bytes(buf.size());
+  simulate_device(buf.size());
+}
+
+void in_memory_backing_store::write(uint64_t obj_id, uint64_t version,
+                                    const char *buf, size_t len) {
+  version_key key(obj_id, version);
+  io_timer timer(stats, io_stats::NODE_WRITE, len);
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    assert(versions.count(key) > 0);
+    versions[key].assign(buf, len);
+  }
+  simulate_device(len);
+}
+
+//a batch costs the device one latency and the transfer time of its bytes.
+//Its time is split among the versions in proportion to their size.
+void in_memory_backing_store::write_batch(std::vector<batch_write> &batch) {
+  if (batch.empty())
+    return;
+  auto start = std::chrono::steady_clock::now();
+  size_t total = 0;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for (auto it = batch.begin(); it != batch.end(); ++it) {
+      versions[version_key(it->obj_id, it->version)].assign(it->buf, it->len);
+      total += it->len;
+    }
+  }
+  simulate_device(total);
+  uint64_t usecs = std::chrono::duration_cast<std::chrono::microseconds>
+    (std::chrono::steady_clock::now() - start).count();
+  for (auto it = batch.begin(); it != batch.end(); ++it)
+    stats.record(io_stats::NODE_WRITE, it->len,
+		 total ? usecs * it->len / total : usecs / batch.size());
+}
+
+std::string in_memory_backing_store::getRootDir(void) {
+  return root;
+}
+
+//stall for the injected latency plus the transfer time of len bytes.
+void in_memory_backing_store::simulate_device(size_t len) {
+  uint64_t delay_us = latency_us;
+  if (bytes_per_sec > 0)
+    delay_us += (uint64_t)len * 1000000 / bytes_per_sec;
+  if (delay_us > 0)
+    usleep(delay_us);
+}
+
 LogFileBackingStore::LogFileBackingStore(std::string logFile)
 {
     logFile_ = logFile;
@@ -96,6 +494,7 @@ LogFileBackingStore::LogFileBackingStore(std::string logFile)
 }
 
 void LogFileBackingStore::appendData(const char* data, int len) {
+  io_timer timer(stats_, io_stats::LOG_APPEND, len);
   std::ofstream file(logFile_, std::ios::app | std::ios::binary);
   assert(file.is_open());
   file.write(data, len);
@@ -105,6 +504,7 @@ void LogFileBackingStore::appendData(const char* data, int len) {
 }
 
 std::ifstream* LogFileBackingStore::get(int &len) {
+    io_timer timer(stats_, io_stats::LOG_READ);
     std::ifstream* filePtr = new std::ifstream(logFile_, std::ios::binary);
     assert(filePtr->is_open()); 
 
@@ -112,11 +512,13 @@ std::ifstream* LogFileBackingStore::get(int &len) {
     filePtr->seekg(0, std::ios::end);
     std::streampos fileSize = filePtr->tellg();
     len = (int)fileSize;
+    timer.set_bytes(len);
     filePtr->seekg(0, std::ios::beg);
     return filePtr;
 }
 
 void LogFileBackingStore::put(const char* data, int len) {
+    io_timer timer(stats_, io_stats::LOG_REWRITE, len);
     std::string oldLogFile = logFile_ + ".old";
     assert(std::rename(logFile_.c_str(), oldLogFile.c_str()) == 0);
     std::ofstream file(logFile_, std::ofstream::out);
@@ -131,6 +533,7 @@ void LogFileBackingStore::put(const char* data, int len) {
 
 // Truncate Log File from the offset begining with len  
 void LogFileBackingStore::truncateLogFile(int len) {
+    io_timer timer(stats_, io_stats::LOG_TRUNCATE);
     // Open the file in binary mode for both reading and writing
     std::fstream file(logFile_, std::ios::in | std::ios::out | std::ios::binary);
     assert(file.is_open());
@@ -144,6 +547,7 @@ void LogFileBackingStore::truncateLogFile(int len) {
 
     assert((int)fileSize - len >= 0);
     int newFileLen = (int)fileSize - len;
+    timer.set_bytes(newFileLen);
     // Read data from len to the end of the file
     char buffer[newFileLen];
     char ch;
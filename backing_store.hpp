@@ -8,6 +8,10 @@
 #include <cstddef>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "io_stats.hpp"
 
 class backing_store {
 public:
@@ -16,19 +20,111 @@ public:
   virtual std::iostream * get(uint64_t obj_id, uint64_t version) = 0;
   virtual void            put(std::iostream *ios) = 0;
   virtual std::string getRootDir(void) = 0;
+
+  // Whole-object transfers.  The defaults go through get()/put();
+  // stores that can move the bytes more cheaply override them.
+  // read(), write() and write_batch() may be called from several
+  // threads at once (see swap_space's background flusher).
+  virtual void read(uint64_t obj_id, uint64_t version, std::string &buf);
+  virtual void write(uint64_t obj_id, uint64_t version,
+                     const char *buf, size_t len);
+
+  // A new version to be written as part of a batch.
+  struct batch_write {
+    uint64_t obj_id;
+    uint64_t version;
+    const char *buf;
+    size_t len;
+  };
+  // Allocate and write several new versions with a single durability
+  // point.  None of them may be relied upon until this returns.
+  virtual void write_batch(std::vector<batch_write> &batch);
+
+  const io_stats & get_stats(void) const { return stats; }
+
+  virtual ~backing_store(void) {}
+
+protected:
+  io_stats stats;
+};
+
+// Block-aligned buffers for O_DIRECT transfers.  Buffers are bucketed
+// by power-of-two capacity and kept for reuse, so steady-state node
+// I/O does not hit the allocator.
+class aligned_buffer_pool {
+public:
+  aligned_buffer_pool(size_t alignment, size_t max_free_per_bucket = 4);
+  ~aligned_buffer_pool(void);
+  char * acquire(size_t len, size_t &capacity);
+  void   release(char *buf, size_t capacity);
+  size_t get_alignment(void) const { return alignment; }
+private:
+  size_t alignment;
+  size_t max_free_per_bucket;
+  std::map<size_t, std::vector<char *> > free_buffers;
+  std::mutex lock;
 };
 
 class one_file_per_object_backing_store: public backing_store {
 public:
-  one_file_per_object_backing_store(std::string rt);
+  one_file_per_object_backing_store(std::string rt, bool direct_io = false);
   void	  allocate(uint64_t obj_id, uint64_t version);
   void		  deallocate(uint64_t obj_id, uint64_t version);
   std::iostream * get(uint64_t obj_id, uint64_t version);
   void            put(std::iostream *ios);
+  void read(uint64_t obj_id, uint64_t version, std::string &buf);
+  void write(uint64_t obj_id, uint64_t version, const char *buf, size_t len);
+  void write_batch(std::vector<batch_write> &batch);
   std::string get_filename(uint64_t obj_id, uint64_t version);
   std::string getRootDir(void);
 private:
+  int open_node_file(const std::string &filename, int flags);
+  void write_file(int fd, const std::string &filename, const char *buf,
+                  size_t len);
+  void sync_file(int fd, const std::string &filename);
+
+  std::string	root;
+  // Bypass the kernel page cache for node reads and writes, so that
+  // the swap_space cache is the only copy of a node in memory.
+  // Settled once, in the constructor, so that threads reading and
+  // writing nodes only ever read it.
+  bool direct_io;
+  aligned_buffer_pool buffers;
+};
+
+// Keeps every object version in RAM.  Meant for benchmarking the CPU
+// side of the tree (serialization, flushing, caching) without device
+// noise.  An optional per-operation latency and bandwidth limit can be
+// injected to model a slow device reproducibly.  Nothing survives the
+// process, so trees on this store cannot be recovered: getRootDir() is
+// a fresh directory under rt, removed again with the store.
+class in_memory_backing_store: public backing_store {
+public:
+  in_memory_backing_store(std::string rt, uint64_t latency_us = 0,
+                          uint64_t bytes_per_sec = 0);
+  ~in_memory_backing_store(void);
+  void	  allocate(uint64_t obj_id, uint64_t version);
+  void		  deallocate(uint64_t obj_id, uint64_t version);
+  std::iostream * get(uint64_t obj_id, uint64_t version);
+  void            put(std::iostream *ios);
+  void read(uint64_t obj_id, uint64_t version, std::string &buf);
+  void write(uint64_t obj_id, uint64_t version, const char *buf, size_t len);
+  void write_batch(std::vector<batch_write> &batch);
+  std::string getRootDir(void);
+private:
+  typedef std::pair<uint64_t, uint64_t> version_key;
+
+  void simulate_device(size_t len);
+
   std::string	root;
+  uint64_t latency_us;
+  uint64_t bytes_per_sec;
+  std::map<version_key, std::string> versions;
+  // Streams handed out by get(), and the version each one belongs to.
+  std::map<std::iostream *, version_key> open_streams;
+  // Protects versions and open_streams.  Device time is simulated
+  // outside it.
+  std::mutex lock;
 };
 
 class LogFileBackingStore {
@@ -39,9 +135,11 @@ public:
     void put(const char* data, int len);
     void truncateLogFile(int len);
     bool isRecoverNeeded(void);
+    const io_stats & getStats(void) const { return stats_; }
 private:
     std::string logFile_;
     bool logExists_;
+    io_stats stats_;
 };
 
-#endif // BACKING_STORE_HPP
\ No newline at end of file
+#endif // BACKING_STORE_HPP
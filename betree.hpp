@@ -6,8 +6,9 @@
 
 // This implementation represents in-memory nodes as objects with two
 // fields:
-// - a std::map mapping keys to child pointers
-// - a std::map mapping (key, timestamp) pairs to messages
+// - a flat_map mapping keys to child pointers
+// - a flat_map mapping (key, timestamp) pairs to messages
+// (flat_maps are sorted arrays, see flat_map.hpp.)
 // Nodes are de/serialized to/from an on-disk representation.
 // I/O is managed transparently by a swap_space object.
 
@@ -50,9 +51,10 @@
 // clean in-memory node only requires a write-back, whereas flushing
 // to an on-disk node requires reading it in and writing it out.
 
-#include <map>
+#include <set>
 #include <vector>
 #include <cassert>
+#include "flat_map.hpp"
 #include "swap_space.hpp"
 #include "backing_store.hpp"
 #include "LogManager.hpp"
@@ -65,13 +67,13 @@ template<class Key>
 class MessageKey {
 public:
   MessageKey(void) :
-    key(),
-    timestamp(0)
+    timestamp(0),
+    key()
   {}
 
   MessageKey(const Key & k, uint64_t tstamp) :
-    key(k),
-    timestamp(tstamp)
+    timestamp(tstamp),
+    key(k)
   {}
 
   static MessageKey range_start(const Key &key) {
@@ -91,19 +93,32 @@ public:
   }
 
   void _serialize(std::iostream &fs, serialization_context &context) const {
-    fs << timestamp << " ";
+    serialize(fs, context, timestamp);
     serialize(fs, context, key);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> timestamp;
+    deserialize(fs, context, timestamp);
     deserialize(fs, context, key);
   }
 
-  Key key;
+  // In the order they are serialized, so that with a raw Key the
+  // whole thing is raw too.
   uint64_t timestamp;
+  Key key;
 };
 
+template<class Key>
+struct serial_raw<MessageKey<Key> > :
+  std::integral_constant<bool, serial_raw<uint64_t>::value &&
+			 serial_raw<Key>::value &&
+			 sizeof(MessageKey<Key>) == sizeof(uint64_t) + sizeof(Key)> {};
+
+template<class Key>
+uint64_t footprint(const MessageKey<Key> &mkey) {
+  return footprint(mkey.key) + sizeof(mkey.timestamp);
+}
+
 template<class Key>
 bool operator<(const MessageKey<Key> & mkey1, const MessageKey<Key> & mkey2) {
   return mkey1.key < mkey2.key ||
@@ -124,7 +139,32 @@ template<class Key>
 bool operator==(const MessageKey<Key> &a, const MessageKey<Key> &b) {
   return a.key == b.key && a.timestamp == b.timestamp;
 }
-  
+
+// Message buffers keyed on uint64_t are searched with
+// count_less_u64_pair(), which reads the keys and timestamps in place
+// from the (key, message) pairs, so they need no column.
+template<> struct flat_map_keys<MessageKey<uint64_t> > {
+  static const bool searches = true;
+  struct column {};
+  static void insert(column &c, size_t i, const MessageKey<uint64_t> &k) {}
+  static void erase(column &c, size_t first, size_t last) {}
+  template<class Entry>
+  static void assign(column &c, const Entry *entries, size_t lo, size_t n) {}
+  static void split(column &from, size_t at, column &to) {}
+  static void append(column &to, column &from) {}
+  template<class Entry>
+  static size_t search(const column &c, const Entry *entries, size_t n,
+		       const MessageKey<uint64_t> &k, bool after) {
+    static_assert(sizeof(Entry) % sizeof(uint64_t) == 0,
+		  "entries must be an array of uint64_t-aligned structs");
+    if (n == 0)
+      return 0;
+    return count_less_u64_pair(&entries->first.key, &entries->first.timestamp,
+			       sizeof(Entry) / sizeof(uint64_t), n,
+			       k.key, k.timestamp, after);
+  }
+  static uint64_t bytes(const column &c) { return 0; }
+};
 
 // The three types of upsert.  An UPDATE specifies a value, v, that
 // will be added (using operator+) to the old value associated to some
@@ -149,12 +189,14 @@ public:
   {}
   
   void _serialize(std::iostream &fs, serialization_context &context) {
-    fs << opcode << " ";
+    serialize(fs, context, (int64_t)opcode);
     serialize(fs, context, val);
   } 
 
   void _deserialize(std::iostream &fs, serialization_context &context) {
-    fs >> opcode;
+    int64_t opc;
+    deserialize(fs, context, opc);
+    opcode = opc;
     deserialize(fs, context, val);
   }
 
@@ -162,6 +204,11 @@ public:
   Value val;
 };
 
+template <class Value>
+uint64_t footprint(const Message<Value> &msg) {
+  return sizeof(msg.opcode) + footprint(msg.val);
+}
+
 template <class Value>
 bool operator==(const Message<Value> &a, const Message<Value> &b) {
   return a.opcode == b.opcode && a.val == b.val;
@@ -170,6 +217,16 @@ bool operator==(const Message<Value> &a, const Message<Value> &b) {
 // Measured in messages.
 #define DEFAULT_MAX_NODE_SIZE (1ULL<<18)
 
+// Internal nodes are stored as deltas against their last full image
+// until the delta holds more than 1/NODE_DELTA_FRACTION as many changes
+// as the image has messages.  A delta starts with NODE_DELTA_MARK.
+#define NODE_DELTA_FRACTION (4)
+#define NODE_DELTA_MARK (UINT64_MAX)
+
+// In SERIAL_COMPACT, entries between restart points of a node's
+// messages are delta-encoded, so a search decodes up to this many.
+#define NODE_RESTART_INTERVAL (16)
+
 // The minimum number of messages that we will flush to an out-of-cache node.
 // Note: we will flush even a single element to a child that is already dirty.
 // Note: we will flush MIN_FLUSH_SIZE/2 items to a clean in-memory child.
@@ -188,17 +245,18 @@ private:
   public:
     child_info(void)
       : child(),
-	child_size(0)
+	child_size(0),
+	buffered(0)
     {}
     
     child_info(node_pointer child, uint64_t child_size)
       : child(child),
-	child_size(child_size)
+	child_size(child_size),
+	buffered(0)
     {}
 
     void _serialize(std::iostream &fs, serialization_context &context) {
       serialize(fs, context, child);
-      fs << " ";
       serialize(fs, context, child_size);
     }
 
@@ -209,9 +267,12 @@ private:
     
     node_pointer child;
     uint64_t child_size;
+    // How many of the parent's messages are for this child.  Kept up
+    // to date by the parent, and not stored.
+    uint64_t buffered;
   };
-  typedef typename std::map<Key, child_info> pivot_map;
-  typedef typename std::map<MessageKey<Key>, Message<Value> > message_map;
+  typedef flat_map<Key, child_info> pivot_map;
+  typedef flat_map<MessageKey<Key>, Message<Value> > message_map;
     
   class node : public serializable {
   public:
@@ -283,16 +344,16 @@ private:
 	       Value &default_value) {
       switch (elt.opcode) {
         case INSERT:
-	        elements.erase(elements.lower_bound(mkey.range_start()),
+	        erase_elements(elements.lower_bound(mkey.range_start()),
 		          elements.upper_bound(mkey.range_end()));
-	        elements[mkey] = elt;
+	        set_element(mkey, elt);
 	        break;
 
         case DELETE:
-	        elements.erase(elements.lower_bound(mkey.range_start()),
+	        erase_elements(elements.lower_bound(mkey.range_start()),
 		          elements.upper_bound(mkey.range_end()));
 	        if (!is_leaf()) {
-	          elements[mkey] = elt;
+	          set_element(mkey, elt);
           }
 	        break;
 
@@ -308,7 +369,7 @@ private:
 	            apply(mkey, Message<Value>(INSERT, dummy + elt.val),
 		                default_value);
 	          } else {
-	            elements[mkey] = elt;
+	            set_element(mkey, elt);
 	          }
           } else {
 	          assert(iter != elements.end() && iter->first.key == mkey.key);
@@ -316,7 +377,7 @@ private:
 	            apply(mkey, Message<Value>(INSERT, iter->second.val + elt.val),
 		              default_value);
 	          } else {
-	            elements[mkey] = elt;	      
+	            set_element(mkey, elt);
 	          }
 	        }
 	      }
@@ -327,6 +388,45 @@ private:
       }
     }
     
+    // Apply a sorted batch of messages.  INSERTs for keys that neither
+    // this node nor the rest of the batch has anything for can't
+    // interact with anything, so they are merged in all at once.  The
+    // others go through apply().
+    void apply_batch(message_map &elts, Value &default_value) {
+      message_map fresh;
+      for (auto it = elts.begin(); it != elts.end(); ++it) {
+	const Key &k = it->first.key;
+	auto next = std::next(it);
+	typename message_map::iterator old;
+	if (it->second.opcode == INSERT &&
+	    (it == elts.begin() || std::prev(it)->first.key != k) &&
+	    (next == elts.end() || next->first.key != k) &&
+	    ((old = get_element_begin(k)) == elements.end() || old->first.key != k))
+	  fresh.emplace_hint(fresh.end(), it->first, it->second);
+	else
+	  apply(it->first, it->second, default_value);
+      }
+      if (fresh.empty())
+	return;
+
+      // The same bookkeeping as set_element().
+      if (!is_leaf()) {
+	auto pivot = get_pivot(fresh.begin()->first.key);
+	for (auto it = fresh.begin(); it != fresh.end(); ++it) {
+	  for (auto next = std::next(pivot);
+	       next != pivots.end() && !(it->first.key < next->first); ++next)
+	    pivot = next;
+	  pivot->second.buffered++;
+	}
+      }
+      if (base_version > 0)
+	for (auto it = fresh.begin(); it != fresh.end(); ++it)
+	  added.insert(added.end(), it->first);
+      elements.merge(fresh);
+      if (base_version > 0 && !delta_worthwhile())
+	forget_base();
+    }
+
     // Requires: there are less than MIN_FLUSH_SIZE things in elements
     //           destined for each child in pivots);
     pivot_map split(betree &bet) {
@@ -355,21 +455,22 @@ private:
 	while(things_moved < (i+1) * things_per_new_leaf &&
 	      (pivot_idx != pivots.end() || elt_idx != elements.end())) {
 	  if (pivot_idx != pivots.end()) {
-	    new_node->pivots[pivot_idx->first] = pivot_idx->second;
+	    new_node->pivots[pivot_idx->first] =
+	      child_info(pivot_idx->second.child, pivot_idx->second.child_size);
 	    ++pivot_idx;
 	    things_moved++;
 	    auto elt_end = get_element_begin(pivot_idx);
 	    while (elt_idx != elt_end) {
-	      new_node->elements[elt_idx->first] = elt_idx->second;
+	      new_node->set_element(elt_idx->first, elt_idx->second);
 	      ++elt_idx;
 	      things_moved++;
 	    }
 	  } else {
 	    // Must be a leaf
 	    assert(pivots.size() == 0);
-	    new_node->elements[elt_idx->first] = elt_idx->second;
+	    new_node->set_element(elt_idx->first, elt_idx->second);
 	    ++elt_idx;
-	    things_moved++;	    
+	    things_moved++;
 	  }
 	}
       }
@@ -382,6 +483,7 @@ private:
       assert(elt_idx == elements.end());
       pivots.clear();
       elements.clear();
+      forget_base();
       return result;
     }
 
@@ -441,9 +543,7 @@ private:
       }
 
       if (is_leaf()) {
-	      for (auto it = elts.begin(); it != elts.end(); ++it) {
-	        apply(it->first, it->second, bet.default_value);
-        }
+	      apply_batch(elts, bet.default_value);
 	      if (elements.size() + pivots.size() >= bet.max_node_size) {
 	        result = split(bet);
         }
@@ -456,27 +556,22 @@ private:
       Key oldmin = pivots.begin()->first;
       MessageKey<Key> newmin = elts.begin()->first;
       if (newmin < oldmin) {
-	      pivots[newmin.key] = pivots[oldmin];
-	      pivots.erase(oldmin);
+	      child_info first = pivots.begin()->second;
+	      pivots.erase(pivots.begin());
+	      pivots[newmin.key] = first;
       }
 
       // If everything is going to a single dirty child, go ahead
-      // and put it there.
+      // and put it there.  Only if nothing for that child is still
+      // buffered here, though: the new messages must not get below
+      // older ones.  (A child can be dirty with messages buffered
+      // above it after recovery, or when it was evicted to the
+      // compressed tier without being written.)
       auto first_pivot_idx = get_pivot(elts.begin()->first.key);
       auto last_pivot_idx = get_pivot((--elts.end())->first.key);
       if (first_pivot_idx == last_pivot_idx &&
-	          first_pivot_idx->second.child.is_dirty()) {
-      	// There shouldn't be anything in our buffer for this child,
-      	// but lets assert that just to be safe.
-	      {
-	        auto next_pivot_idx = next(first_pivot_idx);
-	        auto elt_start = get_element_begin(first_pivot_idx);
-	        auto elt_end = get_element_begin(next_pivot_idx);
-          // Do not know why assert after recovery.
-          // Comment it.
-	        //assert(elt_start == elt_end);
-	      }
-
+	  first_pivot_idx->second.child.is_dirty() &&
+	  first_pivot_idx->second.buffered == 0) {
       	pivot_map new_children = first_pivot_idx->second.child->flush(bet, elts);
       	if (!new_children.empty()) {
       	  pivots.erase(first_pivot_idx);
@@ -489,40 +584,40 @@ private:
 
       } else {
 	
-	for (auto it = elts.begin(); it != elts.end(); ++it)
-	  apply(it->first, it->second, bet.default_value);
+	apply_batch(elts, bet.default_value);
+
+	// Start reading the out-of-core children that are going to get
+	// a batch, so their I/O overlaps with the flushes to the others.
+	if (elements.size() + pivots.size() >= bet.max_node_size) {
+	  for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	    if (it->second.buffered > bet.min_flush_size)
+	      it->second.child.prefetch();
+	}
 
 	// Now flush to out-of-core or clean children as necessary
 	while (elements.size() + pivots.size() >= bet.max_node_size) {
 	  // Find the child with the largest set of messages in our buffer
-	  unsigned int max_size = 0;
+	  uint64_t max_size = 0;
 	  auto child_pivot = pivots.begin();
-	  auto next_pivot = pivots.begin();
 	  for (auto it = pivots.begin(); it != pivots.end(); ++it) {
-	    auto it2 = next(it);
-	    auto elt_it = get_element_begin(it); 
-	    auto elt_it2 = get_element_begin(it2); 
-	    unsigned int dist = distance(elt_it, elt_it2);
-	    if (dist > max_size) {
+	    if (it->second.buffered > max_size) {
 	      child_pivot = it;
-	      next_pivot = it2;
-	      max_size = dist;
+	      max_size = it->second.buffered;
 	    }
 	  }
 	  if (!(max_size > bet.min_flush_size ||
 		(max_size > bet.min_flush_size/2 &&
 		 child_pivot->second.child.is_in_memory())))
 	    break; // We need to split because we have too many pivots
-	  auto elt_child_it = get_element_begin(child_pivot);
-	  auto elt_next_it = get_element_begin(next_pivot);
-	  message_map child_elts(elt_child_it, elt_next_it);
+	  message_map child_elts =
+	    take_elements(get_element_begin(child_pivot),
+			  get_element_begin(std::next(child_pivot)));
 	  pivot_map new_children = child_pivot->second.child->flush(bet, child_elts);
-	  elements.erase(elt_child_it, elt_next_it);
 	  if (!new_children.empty()) {
 	    pivots.erase(child_pivot);
 	    pivots.insert(new_children.begin(), new_children.end());
 	  } else {
-	    first_pivot_idx->second.child_size =
+	    child_pivot->second.child_size =
 	      child_pivot->second.child->pivots.size() +
 	      child_pivot->second.child->elements.size();
 	  }
@@ -543,6 +638,19 @@ private:
     Value query(const betree & bet, const Key k) const
     {
       debug(std::cout << "Querying " << this << std::endl);
+      if (!packed.empty()) {
+	memory_buffer mb(packed.data(), packed.size());
+	std::iostream fs(&mb);
+	uint64_t i = packed_search(fs, MessageKey<Key>::range_start(k), false);
+	MessageKey<Key> mkey;
+	Message<Value> msg;
+	if (i < packed_count)
+	  packed_entry(fs, i, mkey, &msg);
+	if (i == packed_count || mkey.key != k)
+	  throw std::out_of_range("Key does not exist");
+	assert(msg.opcode == INSERT);
+	return msg.val;
+      }
       if (is_leaf()) {
 	auto it = elements.lower_bound(MessageKey<Key>::range_start(k));
 	if (it != elements.end() && it->first.key == k) {
@@ -602,6 +710,11 @@ private:
 	mkey = NULL;
       auto it = mkey ? get_pivot(mkey->key) : pivots.begin();
       while (it != pivots.end()) {
+	// A scan that runs off the end of this child continues in the
+	// next one.
+	auto sibling = std::next(it);
+	if (sibling != pivots.end())
+	  sibling->second.child.prefetch();
 	try {
 	  return it->second.child->get_next_message(mkey);
 	} catch (std::out_of_range & e) {}
@@ -612,6 +725,17 @@ private:
     
     std::pair<MessageKey<Key>, Message<Value> >
     get_next_message(const MessageKey<Key> *mkey) const {
+      if (!packed.empty()) {
+	memory_buffer mb(packed.data(), packed.size());
+	std::iostream fs(&mb);
+	uint64_t i = mkey ? packed_search(fs, *mkey, true) : 0;
+	if (i == packed_count)
+	  throw std::out_of_range("No more messages in sub-tree");
+	std::pair<MessageKey<Key>, Message<Value> > result;
+	packed_entry(fs, i, result.first, &result.second);
+	return result;
+      }
+
       auto it = mkey ? elements.upper_bound(*mkey) : elements.begin();
 
       if (is_leaf()) {
@@ -634,7 +758,60 @@ private:
       }
     }
     
+    // In the binary formats, the elements are their count, a table of
+    // 32-bit offsets of restart points, counted from the end of the
+    // table, and then the entries, in order.  In SERIAL_BINARY every
+    // entry is a restart point.  In SERIAL_COMPACT only every
+    // NODE_RESTART_INTERVAL'th is, and the entries in between store
+    // their timestamp and key as deltas from the entry before (see
+    // serialize_delta()).  The table lets a leaf that has just been
+    // loaded be searched without decoding all of it.
     void _serialize(std::iostream &fs, serialization_context &context) {
+      context.summary.kind = is_leaf() ? NODE_KIND_LEAF : NODE_KIND_INTERNAL;
+      context.summary.pivots = pivots.size();
+      context.summary.elements = elements.size() + packed_count;
+      if (context.binary()) {
+	if (delta_worthwhile()) {
+	  context.summary.kind = NODE_KIND_DELTA;
+	  serialize_delta_record(fs, context);
+	  return;
+	}
+	serialize(fs, context, pivots);
+	if (!packed.empty() && packed_format == context.format) {
+	  // Still exactly as it was read.
+	  fs.write(packed.data() + packed_elements,
+		   packed.size() - packed_elements);
+	  assert(fs.good());
+	  return;
+	}
+	materialize();
+	if (!context.evicting)
+	  // This stays in memory and is about to be written in full.
+	  start_base(context);
+	uint64_t stride = restart_interval(context.format);
+	serialize(fs, context, (uint64_t)elements.size());
+	std::streampos table = fs.tellp();
+	std::vector<uint32_t> offsets((elements.size() + stride - 1) / stride, 0);
+	serialize_array(fs, context, offsets.data(), offsets.size());
+	std::streampos start = fs.tellp();
+	MessageKey<Key> none;
+	const MessageKey<Key> *prev = &none;
+	uint64_t i = 0;
+	for (auto it = elements.begin(); it != elements.end(); ++it, ++i) {
+	  if (i % stride == 0) {
+	    offsets[i / stride] = fs.tellp() - start;
+	    prev = &none;
+	  }
+	  encode_entry(fs, context, *prev, it->first, it->second);
+	  prev = &it->first;
+	}
+	std::streampos end = fs.tellp();
+	fs.seekp(table);
+	serialize_array(fs, context, offsets.data(), offsets.size());
+	fs.seekp(end);
+	return;
+      }
+      materialize();
       fs << "pivots:" << std::endl;
       serialize(fs, context, pivots);
       fs << "elements:" << std::endl;
@@ -642,12 +819,372 @@ private:
     }
     
     void _deserialize(std::iostream &fs, serialization_context &context) {
+      if (context.binary()) {
+	uint64_t npivots;
+	deserialize(fs, context, npivots);
+	if (npivots == NODE_DELTA_MARK) {
+	  deserialize_delta_record(fs, context);
+	  return;
+	}
+	deserialize_pivots(fs, context, npivots);
+	std::streampos start = fs.tellg();
+	uint64_t count;
+	deserialize(fs, context, count);
+	uint64_t stride = restart_interval(context.format);
+	fs.seekg(4 * ((count + stride - 1) / stride), std::ios_base::cur);
+	// A leaf keeps the bytes it was loaded from until it is
+	// modified.  Internal nodes hold pointers, which have to be
+	// deserialized now to keep their objects' refcounts.
+	if (is_leaf() && count > 0 && context.buffer != NULL) {
+	  packed.swap(*context.buffer);
+	  packed_elements = start;
+	  packed_count = count;
+	  packed_format = context.format;
+	  packed_ss = &context.ss;
+	  return;
+	}
+	MessageKey<Key> k;
+	for (uint64_t i = 0; i < count; i++) {
+	  Message<Value> v;
+	  decode_entry(fs, context, i % stride == 0, k, &v);
+	  elements.emplace_hint(elements.end(), k, v);
+	}
+	count_buffered();
+	if (context.version > 0 && !context.detached)
+	  start_base(context);
+	return;
+      }
       std::string dummy;
       fs >> dummy;
       deserialize(fs, context, pivots);
       fs >> dummy;
       deserialize(fs, context, elements);
+      count_buffered();
+    }
+
+    // Unpack a leaf's packed messages into elements.
+    void materialize(void) {
+      if (packed.empty())
+	return;
+      memory_buffer mb(packed.data(), packed.size());
+      std::iostream fs(&mb);
+      serialization_context ctxt(*packed_ss, packed_format);
+      uint64_t stride = restart_interval(packed_format);
+      packed_seek(fs, 0);
+      MessageKey<Key> k;
+      for (uint64_t i = 0; i < packed_count; i++) {
+	Message<Value> v;
+	decode_entry(fs, ctxt, i % stride == 0, k, &v);
+	elements.emplace_hint(elements.end(), k, v);
+      }
+      std::string().swap(packed);
+      packed_count = 0;
+    }
+
+    // Walking every message on every unpin would be too slow, so we
+    // walk them once and then scale by the number of entries, until
+    // that number has drifted by more than an eighth.
+    uint64_t memory_footprint(void) const {
+      uint64_t entries = pivots.size() + elements.size();
+      uint64_t slack = measured_entries / 8;
+      if (measured_entries == 0 ||
+	  entries > measured_entries + slack ||
+	  entries + slack < measured_entries) {
+	measured_entries = entries;
+	measured_bytes = footprint(pivots) + footprint(elements);
+	return sizeof(*this) + packed.capacity() + delta_bytes() + measured_bytes;
+      }
+      return sizeof(*this) + packed.capacity() + delta_bytes() +
+	measured_bytes * entries / measured_entries;
+    }
+
+  private:
+    // A leaf loaded in a binary format keeps its messages packed, in
+    // the bytes it was loaded from, until it is first modified.
+    // elements is empty meanwhile.  The elements section (see
+    // _serialize()) starts at packed_elements.
+    std::string packed;
+    uint64_t packed_elements = 0;
+    uint64_t packed_count = 0;
+    uint8_t packed_format = SERIAL_BINARY;
+    swap_space *packed_ss = NULL;
+
+    static uint64_t restart_interval(uint8_t format) {
+      return format == SERIAL_COMPACT ? NODE_RESTART_INTERVAL : 1;
     }
+
+    // One entry of the elements section.  prev is the entry before, or
+    // a default MessageKey at a restart point.
+    static void encode_entry(std::iostream &fs, serialization_context &context,
+			     const MessageKey<Key> &prev,
+			     const MessageKey<Key> &mkey,
+			     Message<Value> &msg) {
+      if (context.format == SERIAL_COMPACT) {
+	serialize_delta(fs, context, prev.timestamp, mkey.timestamp);
+	serialize_delta(fs, context, prev.key, mkey.key);
+      } else {
+	serialize(fs, context, mkey);
+      }
+      serialize(fs, context, msg);
+    }
+
+    // The other way around.  mkey holds the entry before, unless this
+    // is a restart point.  msg may be NULL if nothing else is going to
+    // be read from fs.
+    static void decode_entry(std::iostream &fs, serialization_context &context,
+			     bool restart, MessageKey<Key> &mkey,
+			     Message<Value> *msg) {
+      if (context.format == SERIAL_COMPACT) {
+	if (restart)
+	  mkey = MessageKey<Key>();
+	deserialize_delta(fs, context, mkey.timestamp);
+	deserialize_delta(fs, context, mkey.key);
+      } else {
+	deserialize(fs, context, mkey);
+      }
+      if (msg)
+	deserialize(fs, context, *msg);
+    }
+
+    // Position fs at packed restart point r.
+    void packed_seek(std::iostream &fs, uint64_t r) const {
+      uint64_t stride = restart_interval(packed_format);
+      uint64_t table = packed_elements + 8;
+      uint64_t entries = table + 4 * ((packed_count + stride - 1) / stride);
+      fs.seekg(entries + load_le(packed.data() + table + 4 * r, 4));
+    }
+
+    // Decode packed entry i.  Leave msg alone if it is NULL.
+    void packed_entry(std::iostream &fs, uint64_t i, MessageKey<Key> &mkey,
+		      Message<Value> *msg) const {
+      uint64_t stride = restart_interval(packed_format);
+      serialization_context ctxt(*packed_ss, packed_format);
+      packed_seek(fs, i / stride);
+      Message<Value> skip;
+      for (uint64_t j = i - i % stride; j < i; j++)
+	decode_entry(fs, ctxt, j % stride == 0, mkey, &skip);
+      decode_entry(fs, ctxt, i % stride == 0, mkey, msg);
+    }
+
+    // Index of the first packed entry after mkey, or, unless strict,
+    // equal to it.  A binary search over the restart points, then a
+    // scan of the run of entries that starts at the one found.
+    uint64_t packed_search(std::iostream &fs, const MessageKey<Key> &mkey,
+			   bool strict) const {
+      uint64_t stride = restart_interval(packed_format);
+      uint64_t lo = 0;
+      uint64_t hi = (packed_count + stride - 1) / stride;
+      MessageKey<Key> k;
+      while (lo < hi) {
+	uint64_t mid = lo + (hi - lo) / 2;
+	packed_entry(fs, mid * stride, k, NULL);
+	if (k < mkey || (strict && k == mkey))
+	  lo = mid + 1;
+	else
+	  hi = mid;
+      }
+      if (lo == 0)
+	return 0;
+      uint64_t end = lo * stride < packed_count ? lo * stride : packed_count;
+      serialization_context ctxt(*packed_ss, packed_format);
+      Message<Value> skip;
+      packed_seek(fs, lo - 1);
+      for (uint64_t i = (lo - 1) * stride; i < end; i++) {
+	decode_entry(fs, ctxt, i % stride == 0, k, &skip);
+	if (!(k < mkey || (strict && k == mkey)))
+	  return i;
+      }
+      return end;
+    }
+
+    // An internal node in a binary format that was last stored in full
+    // as base_version is stored as a delta against that image from then
+    // on: its pivots, the ranges of messages removed from the image,
+    // and the messages added since.  Each delta covers everything since
+    // the image, so a load reads only the image and the latest delta.
+    // A new image is written once the delta has grown past
+    // 1/NODE_DELTA_FRACTION of the image.  base_version is 0 while
+    // there is no usable image.
+    typedef std::pair<MessageKey<Key>, MessageKey<Key> > key_range;
+    uint64_t base_version = 0;
+    uint64_t base_count = 0;
+    uint64_t removed_count = 0;
+    std::vector<key_range> removed;
+    std::set<MessageKey<Key> > added;
+
+    void set_element(const MessageKey<Key> &mkey, const Message<Value> &elt) {
+      uint64_t n = elements.size();
+      elements[mkey] = elt;
+      if (elements.size() > n && !is_leaf())
+	get_pivot(mkey.key)->second.buffered++;
+      if (base_version == 0)
+	return;
+      added.insert(mkey);
+      if (!delta_worthwhile())
+	forget_base();
+    }
+
+    template<class Iterator> void erase_elements(Iterator first, Iterator last) {
+      note_removed(first, last);
+      elements.erase(first, last);
+      if (base_version > 0 && !delta_worthwhile())
+	forget_base();
+    }
+
+    // The same, but hands the messages over.
+    message_map take_elements(typename message_map::iterator first,
+			      typename message_map::iterator last) {
+      note_removed(first, last);
+      message_map taken = elements.extract(first, last);
+      if (base_version > 0 && !delta_worthwhile())
+	forget_base();
+      return taken;
+    }
+
+    // Messages from first to last are about to go.
+    template<class Iterator> void note_removed(Iterator first, Iterator last) {
+      if (!is_leaf() && first != last) {
+	auto pivot = get_pivot(first->first.key);
+	for (Iterator it = first; it != last; ++it) {
+	  for (auto next = std::next(pivot);
+	       next != pivots.end() && !(it->first.key < next->first); ++next)
+	    pivot = next;
+	  assert(pivot->second.buffered > 0);
+	  pivot->second.buffered--;
+	}
+      }
+      if (base_version > 0 && first != last) {
+	// Only what came from the image has to be recorded.
+	uint64_t n = 0;
+	Iterator back = first;
+	for (Iterator it = first; it != last; back = it++)
+	  if (added.erase(it->first) == 0)
+	    n++;
+	if (n > 0) {
+	  removed.push_back(key_range(first->first, back->first));
+	  removed_count += n;
+	}
+      }
+    }
+
+    // Set every child's buffered count from scratch.
+    void count_buffered(void) {
+      for (auto it = pivots.begin(); it != pivots.end(); ++it)
+	it->second.buffered =
+	  elements.distance(get_element_begin(it),
+			    get_element_begin(std::next(it)));
+    }
+
+    // Also checks that every change went through set_element() and
+    // erase_elements().  The flusher may store a node between two
+    // accesses, e.g. while split() is filling it in.
+    bool delta_worthwhile(void) const {
+      return base_version > 0 &&
+	base_count - removed_count + added.size() == elements.size() &&
+	(added.size() + removed_count + removed.size()) * NODE_DELTA_FRACTION
+	<= base_count;
+    }
+
+    void start_base(const serialization_context &context) {
+      forget_base();
+      if (!is_leaf() && context.binary() && context.version > 0) {
+	base_version = context.version;
+	base_count = elements.size();
+      }
+    }
+
+    void forget_base(void) {
+      base_version = 0;
+      base_count = 0;
+      removed_count = 0;
+      std::vector<key_range>().swap(removed);
+      added.clear();
+    }
+
+    uint64_t delta_bytes(void) const {
+      return removed.capacity() * sizeof(key_range) +
+	added.size() * (STD_MAP_NODE_OVERHEAD + sizeof(MessageKey<Key>));
+    }
+
+    // Pivot maps whose count has already been read.
+    void deserialize_pivots(std::iostream &fs, serialization_context &context,
+			    uint64_t count) {
+      for (uint64_t i = 0; i < count; i++) {
+	Key k;
+	child_info c;
+	deserialize(fs, context, k);
+	deserialize(fs, context, c);
+	pivots.emplace_hint(pivots.end(), k, c);
+      }
+    }
+
+    // NODE_DELTA_MARK where a full image has its pivot count, the base
+    // version, the pivots, removed_count and the removed ranges, and
+    // then the added messages.
+    void serialize_delta_record(std::iostream &fs, serialization_context &context) {
+      serialize(fs, context, (uint64_t)NODE_DELTA_MARK);
+      serialize(fs, context, base_version);
+      serialize(fs, context, pivots);
+      serialize(fs, context, removed_count);
+      serialize(fs, context, (uint64_t)removed.size());
+      for (auto it = removed.begin(); it != removed.end(); ++it) {
+	serialize(fs, context, it->first);
+	serialize(fs, context, it->second);
+      }
+      serialize(fs, context, (uint64_t)added.size());
+      for (auto it = added.begin(); it != added.end(); ++it) {
+	auto elt = elements.find(*it);
+	assert(elt != elements.end());
+	serialize(fs, context, elt->first);
+	serialize(fs, context, elt->second);
+      }
+    }
+
+    void deserialize_delta_record(std::iostream &fs, serialization_context &context) {
+      // Images are always stored in full.
+      assert(!context.detached);
+      uint64_t version;
+      deserialize(fs, context, version);
+
+      // The image's pivots are stale, and only its messages are
+      // wanted.
+      std::string raw;
+      uint8_t raw_format;
+      context.ss.read_version(context.id, version, raw, raw_format);
+      memory_buffer mb(raw.data(), raw.size());
+      std::iostream in(&mb);
+      serialization_context image(context.ss, raw_format);
+      image.detached = true;
+      _deserialize(in, image);
+      pivots.clear();
+
+      base_version = version;
+      base_count = elements.size();
+      deserialize(fs, context, pivots);
+      deserialize(fs, context, removed_count);
+      uint64_t n;
+      deserialize(fs, context, n);
+      removed.resize(n);
+      for (auto it = removed.begin(); it != removed.end(); ++it) {
+	deserialize(fs, context, it->first);
+	deserialize(fs, context, it->second);
+	elements.erase(elements.lower_bound(it->first),
+		       elements.upper_bound(it->second));
+      }
+      deserialize(fs, context, n);
+      for (uint64_t i = 0; i < n; i++) {
+	MessageKey<Key> k;
+	Message<Value> v;
+	deserialize(fs, context, k);
+	deserialize(fs, context, v);
+	elements[k] = v;
+	added.insert(added.end(), k);
+      }
+      count_buffered();
+    }
+
+    mutable uint64_t measured_entries = 0;
+    mutable uint64_t measured_bytes = 0;
   };
 
   swap_space *ss;
@@ -786,6 +1323,11 @@ public:
     return v;
   }
 
+  // I/O done on behalf of the write-ahead log.
+  const io_stats & log_io_stats(void) const {
+    return log_->getIoStats();
+  }
+
   void dump_messages(void) {
     std::pair<MessageKey<Key>, Message<Value> > current;
 
@@ -0,0 +1,524 @@
+#include "compression.hpp"
+#include "debug.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+//////////////////////////////////////////////////////
+// LZ codec                                         //
+//////////////////////////////////////////////////////
+
+// The block is a sequence of
+//   token        : high nibble literal length, low nibble match length - 4
+//   [lit. len.]  : if the literal nibble is 15, more length in 255-runs
+//   literals
+//   offset       : 2 bytes, little-endian, distance back to the match
+//   [match len.] : if the match nibble is 15, more length in 255-runs
+// The last sequence carries only literals.
+
+#define LZ_MIN_MATCH     (4)
+#define LZ_LAST_LITERALS (5)
+#define LZ_MAX_OFFSET    (65535)
+#define LZ_HASH_BITS     (14)
+
+class lz_compressor : public compressor {
+public:
+  lz_compressor(void) : table(1 << LZ_HASH_BITS) {}
+
+  uint8_t id(void) const { return CODEC_LZ; }
+  const char * name(void) const { return "lz"; }
+
+  void compress(const char *src, size_t len, std::string &dst) {
+    const uint8_t *in = (const uint8_t *)src;
+    std::fill(table.begin(), table.end(), 0);
+    dst.reserve(dst.size() + len + len / 255 + 16);
+
+    size_t anchor = 0;
+    size_t ip = 0;
+    unsigned misses = 0;
+    if (len > LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+      size_t limit = len - LZ_LAST_LITERALS - LZ_MIN_MATCH;
+      while (ip <= limit) {
+	uint32_t seq = read32(in + ip);
+	uint32_t h = hash(seq);
+	// Positions are stored +1 so that 0 means "empty".
+	size_t ref = table[h];
+	table[h] = ip + 1;
+	if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET ||
+	    read32(in + ref - 1) != seq) {
+	  // Skip ahead faster through incompressible data.
+	  ip += 1 + (misses++ >> 6);
+	  continue;
+	}
+	misses = 0;
+	ref--;
+	size_t mlen = LZ_MIN_MATCH;
+	while (ip + mlen < len - LZ_LAST_LITERALS && in[ref + mlen] == in[ip + mlen])
+	  mlen++;
+	emit_sequence(dst, in + anchor, ip - anchor, ip - ref, mlen);
+	ip += mlen;
+	anchor = ip;
+      }
+    }
+    emit_sequence(dst, in + anchor, len - anchor, 0, 0);
+  }
+
+  bool decompress(const char *src, size_t len, char *dst, size_t dst_len) {
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + dst_len;
+
+    while (ip < iend) {
+      uint8_t token = *ip++;
+      size_t litlen = token >> 4;
+      if (litlen == 15 && !read_length(ip, iend, litlen))
+	return false;
+      if (litlen > (size_t)(iend - ip) || litlen > (size_t)(oend - op))
+	return false;
+      memcpy(op, ip, litlen);
+      ip += litlen;
+      op += litlen;
+      if (ip == iend)
+	break;
+
+      if (iend - ip < 2)
+	return false;
+      size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      size_t mlen = token & 15;
+      if (mlen == 15 && !read_length(ip, iend, mlen))
+	return false;
+      mlen += LZ_MIN_MATCH;
+      if (offset == 0 || (size_t)(op - (uint8_t *)dst) < offset
+	  || mlen > (size_t)(oend - op))
+	return false;
+      // Matches may overlap their own output, so copy forwards.
+      const uint8_t *match = op - offset;
+      for (size_t i = 0; i < mlen; i++)
+	op[i] = match[i];
+      op += mlen;
+    }
+    return op == oend;
+  }
+
+private:
+  std::vector<size_t> table;
+
+  static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static uint32_t hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+  }
+
+  static void write_length(std::string &dst, size_t len) {
+    while (len >= 255) {
+      dst.push_back((char)255);
+      len -= 255;
+    }
+    dst.push_back((char)len);
+  }
+
+  // Adds the 255-run at ip to len.  Returns false if it runs off iend.
+  static bool read_length(const uint8_t *&ip, const uint8_t *iend,
+			  size_t &len) {
+    uint8_t b;
+    do {
+      if (ip == iend)
+	return false;
+      b = *ip++;
+      len += b;
+    } while (b == 255);
+    return true;
+  }
+
+  static void emit_sequence(std::string &dst, const uint8_t *lit, size_t litlen,
+			    size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t token = ((litlen < 15 ? litlen : 15) << 4) | (mcode < 15 ? mcode : 15);
+    dst.push_back((char)token);
+    if (litlen >= 15)
+      write_length(dst, litlen - 15);
+    dst.append((const char *)lit, litlen);
+    if (mlen == 0)
+      return;
+    dst.push_back((char)(offset & 0xff));
+    dst.push_back((char)(offset >> 8));
+    if (mcode >= 15)
+      write_length(dst, mcode - 15);
+  }
+};
+
+//////////////////////////////////////////////////////
+// zlib codec                                       //
+//////////////////////////////////////////////////////
+
+#ifdef HAVE_ZLIB
+class zlib_compressor : public compressor {
+public:
+  uint8_t id(void) const { return CODEC_ZLIB; }
+  const char * name(void) const { return "zlib"; }
+
+  void compress(const char *src, size_t len, std::string &dst) {
+    uLongf bound = compressBound(len);
+    size_t start = dst.size();
+    dst.resize(start + bound);
+    int r = compress2((Bytef *)&dst[start], &bound, (const Bytef *)src, len,
+		      Z_BEST_SPEED);
+    assert(r == Z_OK);
+    dst.resize(start + bound);
+  }
+
+  bool decompress(const char *src, size_t len, char *dst, size_t dst_len) {
+    uLongf out_len = dst_len;
+    int r = uncompress((Bytef *)dst, &out_len, (const Bytef *)src, len);
+    return r == Z_OK && out_len == dst_len;
+  }
+};
+#endif
+
+compressor * get_compressor(uint8_t codec)
+{
+  // The LZ codec keeps its match table between calls, so each thread
+  // gets its own.
+  static thread_local lz_compressor lz;
+#ifdef HAVE_ZLIB
+  static zlib_compressor zlib;
+#endif
+  switch (codec) {
+  case CODEC_LZ:
+    return &lz;
+#ifdef HAVE_ZLIB
+  case CODEC_ZLIB:
+    return &zlib;
+#endif
+  default:
+    return NULL;
+  }
+}
+
+bool parse_codec_name(const std::string &name, uint8_t &codec)
+{
+  if (name == "none") {
+    codec = CODEC_NONE;
+    return true;
+  }
+  if (name == "lz")
+    codec = CODEC_LZ;
+  else if (name == "zlib")
+    codec = CODEC_ZLIB;
+  else
+    return false;
+  return get_compressor(codec) != NULL;
+}
+
+//////////////////////////////////////////////////////
+// CRC32C                                           //
+//////////////////////////////////////////////////////
+
+// Reflected polynomial of CRC32C.
+#define CRC32C_POLY (0x82f63b78U)
+
+// Slicing-by-8: table[k][b] is the CRC of byte b followed by k zero
+// bytes, so eight input bytes take eight lookups and no shifts between
+// them.
+class crc32c_tables {
+public:
+  crc32c_tables(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+      uint32_t crc = b;
+      for (int i = 0; i < 8; i++)
+	crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+      table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++)
+      for (int k = 1; k < 8; k++)
+	table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xff];
+  }
+
+  uint32_t table[8][256];
+};
+
+static uint32_t crc32c_sw(const char *data, size_t len, uint32_t crc)
+{
+  static const crc32c_tables t;
+  const unsigned char *p = (const unsigned char *)data;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			 (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    crc = t.table[7][lo & 0xff] ^ t.table[6][(lo >> 8) & 0xff] ^
+      t.table[5][(lo >> 16) & 0xff] ^ t.table[4][lo >> 24] ^
+      t.table[3][p[4]] ^ t.table[2][p[5]] ^
+      t.table[1][p[6]] ^ t.table[0][p[7]];
+  }
+  while (len--)
+    crc = (crc >> 8) ^ t.table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(const char *data, size_t len, uint32_t crc)
+{
+  uint64_t c = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t w;
+    memcpy(&w, data, sizeof(w));
+    c = _mm_crc32_u64(c, w);
+  }
+  crc = (uint32_t)c;
+  while (len--)
+    crc = _mm_crc32_u8(crc, (unsigned char)*data++);
+  return crc;
+}
+#endif
+
+uint32_t crc32c(const char *data, size_t len, uint32_t crc)
+{
+  crc = ~crc;
+#ifdef HAVE_CRC32C_HW
+  static const bool hw = __builtin_cpu_supports("sse4.2");
+  if (hw)
+    return ~crc32c_hw(data, len, crc);
+#endif
+  return ~crc32c_sw(data, len, crc);
+}
+
+//////////////////////////////////////////////////////
+// Node framing                                     //
+//////////////////////////////////////////////////////
+
+static void put_le(char *&p, uint64_t v, int bytes)
+{
+  for (int i = 0; i < bytes; i++)
+    *p++ = (char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const char *&p, int bytes)
+{
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++)
+    v |= (uint64_t)(uint8_t)*p++ << (8 * i);
+  return v;
+}
+
+static void pack_header(const node_header &h, char *p)
+{
+  put_le(p, h.magic, 4);
+  put_le(p, h.version, 1);
+  put_le(p, h.codec, 1);
+  put_le(p, h.format, 1);
+  put_le(p, h.kind, 1);
+  put_le(p, h.pivots, 4);
+  put_le(p, h.elements, 4);
+  put_le(p, h.raw_size, 8);
+  put_le(p, h.payload_size, 4);
+  put_le(p, h.crc, 4);
+}
+
+static void unpack_header(const char *p, node_header &h)
+{
+  h.magic = get_le(p, 4);
+  h.version = get_le(p, 1);
+  h.codec = get_le(p, 1);
+  h.format = get_le(p, 1);
+  h.kind = get_le(p, 1);
+  h.pivots = get_le(p, 4);
+  h.elements = get_le(p, 4);
+  h.raw_size = get_le(p, 8);
+  h.payload_size = get_le(p, 4);
+  h.crc = get_le(p, 4);
+}
+
+void encode_node(const char *raw, size_t len, uint8_t codec, uint8_t format,
+		 const node_summary &summary, std::string &out)
+{
+  node_header hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = NODE_HEADER_MAGIC;
+  hdr.version = NODE_HEADER_VERSION;
+  hdr.codec = CODEC_NONE;
+  hdr.format = format;
+  hdr.kind = summary.kind;
+  hdr.pivots = summary.pivots;
+  hdr.elements = summary.elements;
+  hdr.raw_size = len;
+
+  out.assign(NODE_HEADER_LEN, '\0');
+  compressor *c = codec == CODEC_NONE ? NULL : get_compressor(codec);
+  if (c) {
+    c->compress(raw, len, out);
+    if (out.size() - NODE_HEADER_LEN < len)
+      hdr.codec = c->id();
+    else
+      out.resize(NODE_HEADER_LEN); // Didn't pay off; store it raw.
+  }
+  if (hdr.codec == CODEC_NONE)
+    out.append(raw, len);
+
+  assert(out.size() - NODE_HEADER_LEN <= UINT32_MAX);
+  hdr.payload_size = out.size() - NODE_HEADER_LEN;
+  pack_header(hdr, &out[0]);
+  hdr.crc = crc32c(out.data(), NODE_HEADER_LEN);
+  hdr.crc = crc32c(out.data() + NODE_HEADER_LEN, hdr.payload_size, hdr.crc);
+  pack_header(hdr, &out[0]);
+}
+
+// Shared by both header versions, once h is filled in.
+static bool check_payload(const node_header &h, std::ostream &why)
+{
+  if (h.codec != CODEC_NONE && get_compressor(h.codec) == NULL) {
+    why << "Node is compressed with unknown codec " << (int)h.codec;
+    return false;
+  }
+  if (h.codec == CODEC_NONE && h.payload_size != h.raw_size) {
+    why << "Uncompressed node payload is " << h.payload_size
+	<< " bytes, header says " << h.raw_size;
+    return false;
+  }
+  return true;
+}
+
+// h is stored's header, unpacked as version 2.
+static bool check_v2(const std::string &stored, node_header &h,
+		     std::ostream &why)
+{
+  // A short payload is the usual sign of a torn write; it is cheaper
+  // to spot than a bad checksum.
+  if (stored.size() < NODE_HEADER_LEN
+      || h.payload_size != stored.size() - NODE_HEADER_LEN) {
+    why << "Node payload is "
+	<< (stored.size() < NODE_HEADER_LEN ? 0 : stored.size() - NODE_HEADER_LEN)
+	<< " bytes, header says " << h.payload_size;
+    return false;
+  }
+  char packed[NODE_HEADER_LEN];
+  uint32_t crc = h.crc;
+  h.crc = 0;
+  pack_header(h, packed);
+  h.crc = crc;
+  if (crc32c(stored.data() + NODE_HEADER_LEN, h.payload_size,
+	     crc32c(packed, NODE_HEADER_LEN)) != crc) {
+    why << "Node failed its checksum";
+    return false;
+  }
+  return check_payload(h, why);
+}
+
+// Fills in h from stored's version-1 header.
+static bool check_v1(const std::string &stored, node_header &h,
+		     std::ostream &why)
+{
+  memset(&h, 0, sizeof(h));
+  if (stored.size() < NODE_HEADER_V1_LEN) {
+    why << "Node is too short for a version-1 header";
+    return false;
+  }
+  const char *p = stored.data();
+  h.magic = get_le(p, 4);
+  h.version = 1;
+  h.codec = get_le(p, 1);
+  h.format = get_le(p, 1);
+  if (get_le(p, 2) != 0) {
+    why << "Version-1 node header has its reserved bytes set";
+    return false;
+  }
+  h.raw_size = get_le(p, 8);
+  h.payload_size = stored.size() - NODE_HEADER_V1_LEN;
+  // Every zlib stream opens with a deflate CMF byte and a flag byte
+  // that together are a multiple of 31.  Checking that keeps a damaged
+  // version-2 node from passing for a zlib-compressed version-1 one.
+  if (h.codec == CODEC_ZLIB
+      && (h.payload_size < 2 || ((uint8_t)p[0] & 0x0f) != 8
+	  || ((uint8_t)p[0] * 256 + (uint8_t)p[1]) % 31 != 0)) {
+    why << "Version-1 node payload is not a zlib stream";
+    return false;
+  }
+  return check_payload(h, why);
+}
+
+bool verify_node(const std::string &stored, node_header *hdr)
+{
+  char buf[NODE_HEADER_LEN];
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, stored.data(), std::min(stored.size(), NODE_HEADER_LEN));
+  node_header h;
+  unpack_header(buf, h);
+
+  std::ostringstream why;
+  bool ok = false;
+  if (h.magic != NODE_HEADER_MAGIC)
+    why << "Node has no header";
+  else if (h.version == NODE_HEADER_VERSION)
+    ok = check_v2(stored, h, why);
+  else
+    why << "Node header version " << (int)h.version
+	<< " is not " << NODE_HEADER_VERSION;
+  // A version-1 header has its codec where the version is now, so one
+  // compressed with CODEC_ZLIB starts out looking like version 2.
+  if (!ok && h.magic == NODE_HEADER_MAGIC && h.version <= CODEC_ZLIB) {
+    node_header h1;
+    std::ostringstream why1;
+    if (check_v1(stored, h1, why1)) {
+      h = h1;
+      ok = true;
+    } else if (h.version != NODE_HEADER_VERSION) {
+      why.str(why1.str());
+    }
+  }
+  if (hdr)
+    *hdr = h;
+  if (!ok)
+    std::cerr << why.str() << std::endl;
+  return ok;
+}
+
+bool decode_node(const std::string &stored, std::string &raw, uint8_t &format,
+		 bool headerless)
+{
+  uint32_t magic = 0;
+  if (stored.size() >= sizeof(magic)) {
+    const char *p = stored.data();
+    magic = get_le(p, sizeof(magic));
+  }
+  // An empty or zeroed file, or a torn write over the first bytes,
+  // also lacks the magic, so only take it for an old node when asked.
+  if (magic != NODE_HEADER_MAGIC && headerless && !stored.empty()) {
+    debug(std::cout << "Node without header, reading it raw" << std::endl);
+    raw = stored;
+    format = 0;
+    return true;
+  }
+  node_header hdr;
+  if (!verify_node(stored, &hdr))
+    return false;
+  format = hdr.format;
+
+  const char *payload = stored.data() + (hdr.version == NODE_HEADER_VERSION
+					 ? NODE_HEADER_LEN : NODE_HEADER_V1_LEN);
+  if (hdr.codec == CODEC_NONE) {
+    raw.assign(payload, hdr.payload_size);
+    return true;
+  }
+  raw.resize(hdr.raw_size);
+  if (!get_compressor(hdr.codec)->decompress(payload, hdr.payload_size,
+					     &raw[0], hdr.raw_size)) {
+    std::cerr << "Node failed to decompress" << std::endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,110 @@
+// Block compression for serialized nodes.  swap_space runs every
+// serialized node through a codec before handing it to the
+// backing_store, and records the codec in a small header in front of
+// the stored bytes so that nodes written with different codecs can be
+// read back side by side.  The header also records the serialization
+// format of the node (see swap_space.hpp), for the same reason, what
+// kind of node it is and a checksum.
+
+// Codecs:
+//   none - store the serialized bytes as-is.
+//   lz   - a fast in-tree LZ77 codec (LZ4-style block format).
+//   zlib - deflate, only when built with HAVE_ZLIB (make Z=1).
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#define CODEC_NONE (0)
+#define CODEC_LZ   (1)
+#define CODEC_ZLIB (2)
+
+class compressor {
+public:
+  virtual uint8_t id(void) const = 0;
+  virtual const char * name(void) const = 0;
+  // Append the compressed form of src to dst.
+  virtual void compress(const char *src, size_t len, std::string &dst) = 0;
+  // Inflate exactly dst_len bytes from src into dst.  Returns false
+  // if src is not the compressed form of dst_len bytes.
+  virtual bool decompress(const char *src, size_t len,
+                          char *dst, size_t dst_len) = 0;
+  virtual ~compressor(void) {}
+};
+
+// Returns NULL if the codec is unknown or not compiled in.
+compressor * get_compressor(uint8_t codec);
+// Maps "none", "lz" and "zlib" to a codec id.  Returns false if the
+// name is unknown or the codec is not compiled in.
+bool parse_codec_name(const std::string &name, uint8_t &codec);
+
+// CRC32C (Castagnoli) of len bytes at data.  Pass the result of an
+// earlier call as crc to continue it over more bytes.  Uses the SSE4.2
+// crc32 instruction when the CPU has it.
+uint32_t crc32c(const char *data, size_t len, uint32_t crc = 0);
+
+// What a stored node is, as far as can be told without decoding it.
+// The serializer fills one in; swap_space copies it into the header.
+#define NODE_KIND_UNKNOWN  (0)
+#define NODE_KIND_LEAF     (1)
+#define NODE_KIND_INTERNAL (2)
+// An internal node stored as a delta against an older version of it.
+#define NODE_KIND_DELTA    (3)
+
+struct node_summary {
+  uint8_t  kind;
+  uint32_t pivots;
+  uint32_t elements;
+};
+
+// Every stored node version starts with this header, packed field by
+// field in the order below with no padding and every integer
+// little-endian, whatever the host.  crc covers the header, with crc
+// itself zero, and the stored payload after it, so a torn or damaged
+// write is caught before anything is decompressed or decoded.
+//
+// Nodes written before checksums have a 16-byte version-1 header
+// instead: magic, codec, format, two zero bytes and raw_size.  They
+// are still read, so switching to this header does not strand them,
+// but nothing but their length and codec stream can be checked.
+#define NODE_HEADER_MAGIC   (0x444e5442U) // "BTND"
+#define NODE_HEADER_VERSION (2)
+
+struct node_header {
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  codec;
+  uint8_t  format;
+  uint8_t  kind;
+  uint32_t pivots;
+  uint32_t elements;
+  uint64_t raw_size;
+  uint32_t payload_size;
+  uint32_t crc;
+};
+
+const size_t NODE_HEADER_LEN = 32;
+const size_t NODE_HEADER_V1_LEN = 16;
+
+// Frame a node serialized in format for the backing store, compressing
+// it with codec.  Falls back to CODEC_NONE when compression does not
+// pay.
+void encode_node(const char *raw, size_t len, uint8_t codec, uint8_t format,
+		 const node_summary &summary, std::string &out);
+// Check the header of a stored node and its checksum.  Returns false,
+// saying why on std::cerr, if the node is damaged or in a layout this
+// build does not know.  Fills in hdr if it is not NULL; a version-1
+// header is filled in as version 1, with no kind, counts or crc.
+bool verify_node(const std::string &stored, node_header *hdr = NULL);
+// Undo encode_node, verifying the node first.  Returns false if
+// verify_node() does, which includes data without a header.  If
+// headerless is true, non-empty data without a header is instead
+// taken to be a node written before headers existed: it is passed
+// through as-is, unchecked, and is in format 0 (text).
+bool decode_node(const std::string &stored, std::string &raw, uint8_t &format,
+		 bool headerless = false);
+
+#endif // COMPRESSION_HPP
@@ -0,0 +1,374 @@
+#include "eviction_policy.hpp"
+#include <cassert>
+#include <cstddef>
+
+cache_entry::cache_entry(void)
+  : pincount(0),
+    target_is_dirty(false),
+    resident(false),
+    internal(false),
+    policy_prev(NULL),
+    policy_next(NULL),
+    policy_in(NULL),
+    referenced(false)
+{}
+
+/////////////////////////////////////////////////////////////
+// policy_list                                             //
+/////////////////////////////////////////////////////////////
+
+policy_list::policy_list(void)
+  : head(NULL),
+    tail(NULL),
+    size(0)
+{}
+
+void policy_list::push_back(cache_entry *e)
+{
+  assert(e->policy_in == NULL);
+  e->policy_prev = tail;
+  e->policy_next = NULL;
+  if (tail)
+    tail->policy_next = e;
+  else
+    head = e;
+  tail = e;
+  e->policy_in = this;
+  size++;
+}
+
+void policy_list::insert_before(cache_entry *pos, cache_entry *e)
+{
+  assert(e->policy_in == NULL && pos->policy_in == this);
+  e->policy_next = pos;
+  e->policy_prev = pos->policy_prev;
+  if (pos->policy_prev)
+    pos->policy_prev->policy_next = e;
+  else
+    head = e;
+  pos->policy_prev = e;
+  e->policy_in = this;
+  size++;
+}
+
+void policy_list::unlink(cache_entry *e)
+{
+  assert(e->policy_in == this);
+  if (e->policy_prev)
+    e->policy_prev->policy_next = e->policy_next;
+  else
+    head = e->policy_next;
+  if (e->policy_next)
+    e->policy_next->policy_prev = e->policy_prev;
+  else
+    tail = e->policy_prev;
+  e->policy_prev = NULL;
+  e->policy_next = NULL;
+  e->policy_in = NULL;
+  size--;
+}
+
+/////////////////////////////////////////////////////////////
+// eviction_policy                                         //
+/////////////////////////////////////////////////////////////
+
+eviction_policy::eviction_policy(void)
+  : capacity(1),
+    prefer_clean(false),
+    protect_internal(false)
+{}
+
+cache_entry * eviction_policy::pick_from(policy_list &l)
+{
+  // Protected entries are stepped over where they are.  Moving them
+  // would reorder the list, and make them look recently used once the
+  // protection ends.  There are only as many as fit in the internal
+  // share of the cache.
+  cache_entry *first = NULL;
+  int candidates = 0;
+  for (cache_entry *e = l.head; e != NULL; e = e->policy_next) {
+    if (unavailable(e))
+      continue;
+    assert(e->resident);
+    if (!prefer_clean || !e->target_is_dirty)
+      return e;
+    if (first == NULL)
+      first = e;
+    if (++candidates >= PREFER_CLEAN_SCAN)
+      break;
+  }
+  return first;
+}
+
+/////////////////////////////////////////////////////////////
+// LRU                                                     //
+/////////////////////////////////////////////////////////////
+
+// Pinned entries are kept off the list, so everything on it is
+// evictable and the victim is (almost always) its head.
+class lru_policy : public eviction_policy {
+public:
+  const char * name(void) const { return "lru"; }
+
+  void on_insert(cache_entry *e) {
+    if (e->pincount == 0)
+      lru.push_back(e);
+  }
+
+  void on_pin(cache_entry *e) {
+    if (lru.contains(e))
+      lru.unlink(e);
+  }
+
+  void on_unpin(cache_entry *e) {
+    if (e->resident)
+      lru.push_back(e);
+  }
+
+  void on_evict(cache_entry *e) {
+    if (lru.contains(e))
+      lru.unlink(e);
+  }
+
+  void on_forget(cache_entry *e) {
+    on_evict(e);
+  }
+
+  cache_entry * choose_victim(void) {
+    return pick_from(lru);
+  }
+
+private:
+  policy_list lru;
+};
+
+/////////////////////////////////////////////////////////////
+// CLOCK                                                   //
+/////////////////////////////////////////////////////////////
+
+// Resident entries sit on a ring swept by a hand.  An access sets the
+// entry's reference bit; the hand clears reference bits and evicts
+// the first unpinned entry whose bit is already clear.
+class clock_policy : public eviction_policy {
+public:
+  clock_policy(void) : hand(NULL) {}
+
+  const char * name(void) const { return "clock"; }
+
+  void on_insert(cache_entry *e) {
+    // New entries go just behind the hand, i.e. they are the last the
+    // hand will reach.
+    e->referenced = true;
+    if (hand)
+      ring.insert_before(hand, e);
+    else {
+      ring.push_back(e);
+      hand = e;
+    }
+  }
+
+  void on_access(cache_entry *e) {
+    e->referenced = true;
+  }
+
+  void on_evict(cache_entry *e) {
+    if (!ring.contains(e))
+      return;
+    if (hand == e)
+      advance();
+    if (hand == e)
+      hand = NULL;
+    ring.unlink(e);
+  }
+
+  void on_forget(cache_entry *e) {
+    on_evict(e);
+  }
+
+  cache_entry * choose_victim(void) {
+    cache_entry *fallback = NULL;
+    int dirty_skipped = 0;
+    // Two laps clear every reference bit, so a third is never needed.
+    for (uint64_t steps = 0; hand != NULL && steps < 2 * ring.size + 1; steps++) {
+      cache_entry *e = hand;
+      advance();
+      if (unavailable(e))
+	continue;
+      if (e->referenced) {
+	e->referenced = false;
+	continue;
+      }
+      if (prefer_clean && e->target_is_dirty && dirty_skipped < PREFER_CLEAN_SCAN) {
+	if (fallback == NULL)
+	  fallback = e;
+	dirty_skipped++;
+	continue;
+      }
+      return e;
+    }
+    return fallback;
+  }
+
+private:
+  void advance(void) {
+    hand = hand->policy_next ? hand->policy_next : ring.head;
+  }
+
+  policy_list ring;
+  cache_entry *hand;
+};
+
+/////////////////////////////////////////////////////////////
+// 2Q                                                      //
+/////////////////////////////////////////////////////////////
+
+// Johnson and Shasha's full 2Q.  a1in is a FIFO of entries seen once
+// (about a quarter of the cache), am an LRU of entries seen again,
+// and a1out a ghost FIFO of entries recently evicted from a1in.
+class two_queue_policy : public eviction_policy {
+public:
+  const char * name(void) const { return "2q"; }
+
+  void on_insert(cache_entry *e) {
+    if (a1out.contains(e)) {
+      a1out.unlink(e);
+      am.push_back(e);
+    } else {
+      a1in.push_back(e);
+    }
+  }
+
+  void on_access(cache_entry *e) {
+    // Hits in a1in are treated as correlated references and ignored.
+    if (am.contains(e)) {
+      am.unlink(e);
+      am.push_back(e);
+    }
+  }
+
+  void on_evict(cache_entry *e) {
+    if (a1in.contains(e)) {
+      a1in.unlink(e);
+      a1out.push_back(e);
+      while (a1out.size > kout())
+	a1out.unlink(a1out.head);
+    } else if (am.contains(e)) {
+      am.unlink(e);
+    }
+  }
+
+  void on_forget(cache_entry *e) {
+    if (e->policy_in)
+      e->policy_in->unlink(e);
+  }
+
+  cache_entry * choose_victim(void) {
+    cache_entry *victim = NULL;
+    if (a1in.size > kin() || am.size == 0)
+      victim = pick_from(a1in);
+    if (victim == NULL)
+      victim = pick_from(am);
+    if (victim == NULL)
+      victim = pick_from(a1in);
+    return victim;
+  }
+
+private:
+  uint64_t kin(void) const { return capacity / 4 > 0 ? capacity / 4 : 1; }
+  uint64_t kout(void) const { return capacity / 2 > 0 ? capacity / 2 : 1; }
+
+  policy_list a1in;
+  policy_list am;
+  policy_list a1out;
+};
+
+/////////////////////////////////////////////////////////////
+// ARC                                                     //
+/////////////////////////////////////////////////////////////
+
+// Megiddo and Modha's Adaptive Replacement Cache.  t1 holds entries
+// seen once recently, t2 entries seen at least twice; b1 and b2 are
+// ghosts of entries evicted from each.  A ghost hit in b1 (b2) grows
+// (shrinks) p, the target size of t1.
+class arc_policy : public eviction_policy {
+public:
+  arc_policy(void) : p(0) {}
+
+  const char * name(void) const { return "arc"; }
+
+  void on_insert(cache_entry *e) {
+    if (b1.contains(e)) {
+      uint64_t delta = b2.size > b1.size ? b2.size / b1.size : 1;
+      p = p + delta < capacity ? p + delta : capacity;
+      b1.unlink(e);
+      t2.push_back(e);
+    } else if (b2.contains(e)) {
+      uint64_t delta = b1.size > b2.size ? b1.size / b2.size : 1;
+      p = p > delta ? p - delta : 0;
+      b2.unlink(e);
+      t2.push_back(e);
+    } else {
+      t1.push_back(e);
+    }
+    trim_ghosts();
+  }
+
+  void on_access(cache_entry *e) {
+    if (t1.contains(e) || t2.contains(e)) {
+      e->policy_in->unlink(e);
+      t2.push_back(e);
+    }
+  }
+
+  void on_evict(cache_entry *e) {
+    if (t1.contains(e)) {
+      t1.unlink(e);
+      b1.push_back(e);
+    } else if (t2.contains(e)) {
+      t2.unlink(e);
+      b2.push_back(e);
+    }
+    trim_ghosts();
+  }
+
+  void on_forget(cache_entry *e) {
+    if (e->policy_in)
+      e->policy_in->unlink(e);
+  }
+
+  cache_entry * choose_victim(void) {
+    bool from_t1 = t1.size > 0 && (t1.size > p || t2.size == 0);
+    cache_entry *victim = pick_from(from_t1 ? t1 : t2);
+    if (victim == NULL)
+      victim = pick_from(from_t1 ? t2 : t1);
+    return victim;
+  }
+
+private:
+  // Keep |t1| + |b1| <= c and the whole directory within 2c.
+  void trim_ghosts(void) {
+    while (b1.size > 0 && t1.size + b1.size > capacity)
+      b1.unlink(b1.head);
+    while (b2.size > 0 && t1.size + t2.size + b1.size + b2.size > 2 * capacity)
+      b2.unlink(b2.head);
+  }
+
+  policy_list t1;
+  policy_list t2;
+  policy_list b1;
+  policy_list b2;
+  uint64_t p;
+};
+
+eviction_policy * make_eviction_policy(const std::string &name)
+{
+  if (name == "lru")
+    return new lru_policy;
+  if (name == "clock")
+    return new clock_policy;
+  if (name == "2q")
+    return new two_queue_policy;
+  if (name == "arc")
+    return new arc_policy;
+  return NULL;
+}
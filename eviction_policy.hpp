@@ -0,0 +1,121 @@
+// Eviction policies for swap_space.
+
+// A policy sees every object that the swap_space manages as a
+// cache_entry, and is told when an entry becomes resident, is
+// accessed, pinned, unpinned, evicted or destroyed.  When the
+// swap_space is over budget it asks the policy for a victim, which
+// must be resident and unpinned.
+
+// Policies:
+//   lru   - plain least-recently-used.
+//   clock - CLOCK (second chance) approximation of LRU.
+//   2q    - 2Q: first-time entries go through a small FIFO, and only
+//           entries re-referenced after falling out of it (tracked by
+//           a ghost list) are promoted to the main LRU.  A single scan
+//           cannot flush the main LRU.
+//   arc   - ARC: adaptively balances recency and frequency lists,
+//           using ghost lists of recently evicted entries.
+
+// Any policy can be told to prefer clean victims: among the first few
+// candidates it would evict, it then picks a clean one if it can,
+// since evicting a dirty entry costs a write.
+
+// Any policy can also be told to protect internal entries (the
+// swap_space does so while they are within their reserved share of
+// the cache).  It then only picks among the others.
+
+#ifndef EVICTION_POLICY_HPP
+#define EVICTION_POLICY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class policy_list;
+
+class cache_entry {
+public:
+  cache_entry(void);
+
+  // Atomic so that the swap_space can pin an already pinned entry
+  // without taking its lock.  It only goes from 0 to 1, or back, with
+  // the lock held.
+  std::atomic<uint64_t> pincount;
+  // Atomic so that a pinned entry's owner can see, without the lock,
+  // that there is no need to mark it dirty again.
+  std::atomic<bool> target_is_dirty;
+  bool resident;
+  // Set by the swap_space for resident entries that point to others.
+  bool internal;
+
+  // Policy bookkeeping.  An entry is on at most one policy_list.
+  cache_entry *policy_prev;
+  cache_entry *policy_next;
+  policy_list *policy_in;
+  bool referenced;
+};
+
+// Intrusive doubly-linked list of cache entries, oldest at the head.
+class policy_list {
+public:
+  policy_list(void);
+  void push_back(cache_entry *e);
+  void insert_before(cache_entry *pos, cache_entry *e);
+  void unlink(cache_entry *e);
+  bool contains(const cache_entry *e) const { return e->policy_in == this; }
+
+  cache_entry *head;
+  cache_entry *tail;
+  uint64_t size;
+};
+
+// How many evictable candidates a policy looks at when trying to find
+// a clean victim.
+#define PREFER_CLEAN_SCAN (8)
+
+class eviction_policy {
+public:
+  eviction_policy(void);
+  virtual ~eviction_policy(void) {}
+
+  virtual const char * name(void) const = 0;
+
+  // e just became resident (newly allocated or loaded).
+  virtual void on_insert(cache_entry *e) = 0;
+  // e is resident and was accessed.
+  virtual void on_access(cache_entry *e) {}
+  // e's pincount went from 0 to 1, or back to 0.
+  virtual void on_pin(cache_entry *e) {}
+  virtual void on_unpin(cache_entry *e) {}
+  // e was written back and is no longer resident.
+  virtual void on_evict(cache_entry *e) = 0;
+  // e is being destroyed.  Forget everything about it.
+  virtual void on_forget(cache_entry *e) = 0;
+  // Return a resident, unpinned entry to evict, or NULL if none.
+  virtual cache_entry * choose_victim(void) = 0;
+
+  // Number of resident entries the cache aims to hold.
+  void set_capacity(uint64_t c) { capacity = c > 0 ? c : 1; }
+  void set_prefer_clean(bool p) { prefer_clean = p; }
+  void set_protect_internal(bool p) { protect_internal = p; }
+
+protected:
+  // The first available entry from the head of l, or, when preferring
+  // clean victims, the first clean one among the first
+  // PREFER_CLEAN_SCAN available entries.  Leaves l as it is.
+  cache_entry * pick_from(policy_list &l);
+
+  // Pinned entries, and internal ones while they are protected.
+  bool unavailable(const cache_entry *e) const {
+    return e->pincount > 0 || (protect_internal && e->internal);
+  }
+
+  uint64_t capacity;
+  bool prefer_clean;
+  bool protect_internal;
+};
+
+// Returns NULL for an unknown policy name.
+eviction_policy * make_eviction_policy(const std::string &name);
+
+#endif // EVICTION_POLICY_HPP
@@ -0,0 +1,562 @@
+// A sorted map kept in contiguous arrays, for the buffers and pivots
+// of betree nodes.
+
+// Entries live in order in a sequence of chunks, each a std::vector
+// of up to FLAT_MAP_CHUNK (key, value) pairs, so that a node's
+// messages take a handful of allocations instead of one each, and
+// walking them (to flush, split or serialize a node) reads memory in
+// order.  A lookup is a binary search over the chunks, by their last
+// keys, and then one within a chunk.  Small maps are a single sorted
+// array.
+
+// The interface is the part of std::map that betree uses, with two
+// differences:
+// - Any insertion or erasure invalidates every iterator and reference
+//   into the map.
+// - value_type is std::pair<Key, Value>, not std::pair<const Key,
+//   Value>.  Changing a key through an iterator breaks the map.
+
+// Entries appended in order fill each chunk before starting the next,
+// so building a map from sorted input (e.g. deserializing a node, or
+// copying a range of another map) leaves it packed.  Other insertions
+// split a full chunk in half, and erasures fold a chunk into the next
+// one when both fit in 3/4 of a chunk.  extract() moves a range out
+// into a map of its own, handing over the chunks inside the range, and
+// merge() moves a whole map in, merging it with each chunk at once.
+
+// Chunks are searched with std::lower_bound over their entries,
+// unless flat_map_keys<Key> is specialized with a search of its own.
+// That search can read the keys in place, or keep a copy of each
+// chunk's keys, a column, in a form it can search faster.  Below,
+// uint64_t keys keep a column, which is searched with SIMD compares
+// (see key_search.hpp).  Message keys (see betree.hpp) are compared
+// the same way, in place.
+
+#ifndef FLAT_MAP_HPP
+#define FLAT_MAP_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "key_search.hpp"
+
+#define FLAT_MAP_CHUNK (128)
+
+// What a specialization provides.  search() returns the index of the
+// first of the n entries (whose keys are in the column) that is not
+// less than k, or, if after, greater than k.
+template<class Key> struct flat_map_keys {
+  static const bool searches = false;
+  struct column {};
+  static void insert(column &c, size_t i, const Key &k) {}
+  static void erase(column &c, size_t first, size_t last) {}
+  // Make the column hold the keys of the n entries, whose first lo
+  // keys it already has.
+  template<class Entry>
+  static void assign(column &c, const Entry *entries, size_t lo, size_t n) {}
+  // Move the keys from at on to the empty column to.
+  static void split(column &from, size_t at, column &to) {}
+  // Move all of from's keys to the end of to.
+  static void append(column &to, column &from) {}
+  template<class Entry>
+  static size_t search(const column &c, const Entry *entries, size_t n,
+		       const Key &k, bool after) {
+    return 0;
+  }
+  static uint64_t bytes(const column &c) { return 0; }
+};
+
+// Helpers for columns made of vectors.
+template<class X> void flat_map_column_insert(std::vector<X> &v, size_t i,
+					      const X &x)
+{
+  v.insert(v.begin() + i, x);
+}
+
+template<class X> void flat_map_column_erase(std::vector<X> &v, size_t first,
+					     size_t last)
+{
+  v.erase(v.begin() + first, v.begin() + last);
+}
+
+template<class X> void flat_map_column_split(std::vector<X> &from, size_t at,
+					     std::vector<X> &to)
+{
+  to.assign(from.begin() + at, from.end());
+  from.resize(at);
+}
+
+template<class X> void flat_map_column_append(std::vector<X> &to,
+					      std::vector<X> &from)
+{
+  to.insert(to.end(), from.begin(), from.end());
+}
+
+template<> struct flat_map_keys<uint64_t> {
+  static const bool searches = true;
+  typedef std::vector<uint64_t> column;
+  static void insert(column &c, size_t i, uint64_t k) {
+    flat_map_column_insert(c, i, k);
+  }
+  static void erase(column &c, size_t first, size_t last) {
+    flat_map_column_erase(c, first, last);
+  }
+  template<class Entry>
+  static void assign(column &c, const Entry *entries, size_t lo, size_t n) {
+    c.resize(n);
+    for (size_t i = lo; i < n; i++)
+      c[i] = entries[i].first;
+  }
+  static void split(column &from, size_t at, column &to) {
+    flat_map_column_split(from, at, to);
+  }
+  static void append(column &to, column &from) {
+    flat_map_column_append(to, from);
+  }
+  template<class Entry>
+  static size_t search(const column &c, const Entry *entries, size_t n,
+		       uint64_t k, bool after) {
+    return count_less_u64(c.data(), n, k, after);
+  }
+  static uint64_t bytes(const column &c) {
+    return c.capacity() * sizeof(uint64_t);
+  }
+};
+
+template<class Key, class Value> class flat_map {
+public:
+  typedef Key key_type;
+  typedef Value mapped_type;
+  typedef std::pair<Key, Value> value_type;
+  typedef size_t size_type;
+
+private:
+  typedef flat_map_keys<Key> keys;
+
+  // A run of entries, and their keys' column.
+  struct chunk {
+    std::vector<value_type> entries;
+    typename keys::column column;
+
+    size_t size(void) const { return entries.size(); }
+    bool empty(void) const { return entries.empty(); }
+    const Key & last(void) const { return entries.back().first; }
+
+    void insert(size_t i, value_type &&v) {
+      keys::insert(column, i, v.first);
+      entries.insert(entries.begin() + i, std::move(v));
+    }
+
+    void erase(size_t first, size_t last) {
+      keys::erase(column, first, last);
+      entries.erase(entries.begin() + first, entries.begin() + last);
+    }
+
+    void swap(chunk &other) {
+      entries.swap(other.entries);
+      std::swap(column, other.column);
+    }
+
+    // Move the entries from at on to the empty chunk to.
+    void split(size_t at, chunk &to) {
+      keys::split(column, at, to.column);
+      to.entries.assign(std::make_move_iterator(entries.begin() + at),
+			std::make_move_iterator(entries.end()));
+      entries.erase(entries.begin() + at, entries.end());
+    }
+
+    // Move all of from's entries to the end of this one.
+    void append(chunk &from) {
+      keys::append(column, from.column);
+      entries.insert(entries.end(),
+		     std::make_move_iterator(from.entries.begin()),
+		     std::make_move_iterator(from.entries.end()));
+    }
+
+    // Merge the entries from first to last, none of whose keys are
+    // here, into this chunk, which may overfill it.  Each entry already
+    // here moves at most once.
+    template<class Iterator> void merge(Iterator first, Iterator last,
+					size_t n) {
+      size_t hi = size();
+      size_t out = hi + n;
+      entries.resize(out);
+      while (last != first) {
+	--last;
+	size_t pos = search(last->first, false, hi);
+	std::move_backward(entries.begin() + pos, entries.begin() + hi,
+			   entries.begin() + out);
+	out -= hi - pos + 1;
+	hi = pos;
+	entries[out] = std::move(*last);
+      }
+      keys::assign(column, entries.data(), hi, size());
+    }
+
+    size_t search(const Key &k, bool after) const {
+      return search(k, after, size());
+    }
+
+    // The same, among the first n entries.
+    size_t search(const Key &k, bool after, size_t n) const {
+      if (keys::searches)
+	return keys::search(column, entries.data(), n, k, after);
+      if (after)
+	return std::upper_bound(entries.begin(), entries.begin() + n, k,
+				[](const Key &a, const value_type &b) {
+				  return a < b.first;
+				}) - entries.begin();
+      return std::lower_bound(entries.begin(), entries.begin() + n, k,
+			      [](const value_type &a, const Key &b) {
+				return a.first < b;
+			      }) - entries.begin();
+    }
+  };
+
+  template<bool Const> class basic_iterator {
+    typedef typename std::conditional<Const, const flat_map, flat_map>::type
+    map_type;
+  public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename flat_map::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename std::conditional<Const, const value_type,
+				      value_type>::type & reference;
+    typedef typename std::conditional<Const, const value_type,
+				      value_type>::type * pointer;
+
+    basic_iterator(void) : m(NULL), c(0), i(0) {}
+    basic_iterator(map_type *m, size_t c, size_t i) : m(m), c(c), i(i) {}
+    // iterator converts to const_iterator.
+    template<bool C, class = typename std::enable_if<Const && !C>::type>
+    basic_iterator(const basic_iterator<C> &other)
+      : m(other.m), c(other.c), i(other.i) {}
+
+    reference operator*(void) const { return m->chunks[c].entries[i]; }
+    pointer operator->(void) const { return &m->chunks[c].entries[i]; }
+
+    basic_iterator & operator++(void) {
+      if (++i == m->chunks[c].size()) {
+	c++;
+	i = 0;
+      }
+      return *this;
+    }
+
+    basic_iterator operator++(int) {
+      basic_iterator old = *this;
+      ++*this;
+      return old;
+    }
+
+    basic_iterator & operator--(void) {
+      if (i == 0)
+	i = m->chunks[--c].size();
+      i--;
+      return *this;
+    }
+
+    basic_iterator operator--(int) {
+      basic_iterator old = *this;
+      --*this;
+      return old;
+    }
+
+    template<bool C> bool operator==(const basic_iterator<C> &other) const {
+      return c == other.c && i == other.i;
+    }
+
+    template<bool C> bool operator!=(const basic_iterator<C> &other) const {
+      return !(*this == other);
+    }
+
+  private:
+    friend class flat_map;
+    template<bool C> friend class basic_iterator;
+
+    // Entry i of chunk c.  end() is (chunks.size(), 0), and i is
+    // always within the chunk otherwise.
+    map_type *m;
+    size_t c;
+    size_t i;
+  };
+
+public:
+  typedef basic_iterator<false> iterator;
+  typedef basic_iterator<true> const_iterator;
+
+  flat_map(void) : count(0) {}
+
+  // Sorted input is appended chunk by chunk.
+  template<class InputIterator>
+  flat_map(InputIterator first, InputIterator last) : count(0) {
+    insert(first, last);
+  }
+
+  size_type size(void) const { return count; }
+  bool empty(void) const { return count == 0; }
+
+  // Bytes held besides the entries themselves: the chunk table, the
+  // unused room at the end of each chunk and the key columns.
+  uint64_t overhead_bytes(void) const {
+    uint64_t total = sizeof(*this) + chunks.capacity() * sizeof(chunk);
+    for (auto it = chunks.begin(); it != chunks.end(); ++it)
+      total += (it->entries.capacity() - it->size()) * sizeof(value_type) +
+	keys::bytes(it->column);
+    return total;
+  }
+
+  void clear(void) {
+    std::vector<chunk>().swap(chunks);
+    count = 0;
+  }
+
+  iterator begin(void) { return iterator(this, 0, 0); }
+  const_iterator begin(void) const { return const_iterator(this, 0, 0); }
+  iterator end(void) { return iterator(this, chunks.size(), 0); }
+  const_iterator end(void) const { return const_iterator(this, chunks.size(), 0); }
+
+  // The first entry whose key is not less than k.
+  iterator lower_bound(const Key &k) {
+    return position<iterator>(this, k, false);
+  }
+
+  const_iterator lower_bound(const Key &k) const {
+    return position<const_iterator>(this, k, false);
+  }
+
+  // The first entry whose key is greater than k.
+  iterator upper_bound(const Key &k) {
+    return position<iterator>(this, k, true);
+  }
+
+  const_iterator upper_bound(const Key &k) const {
+    return position<const_iterator>(this, k, true);
+  }
+
+  iterator find(const Key &k) {
+    iterator it = lower_bound(k);
+    return it != end() && !(k < it->first) ? it : end();
+  }
+
+  const_iterator find(const Key &k) const {
+    const_iterator it = lower_bound(k);
+    return it != end() && !(k < it->first) ? it : end();
+  }
+
+  // Same as std::distance(first, last), but only walks the chunks.
+  size_type distance(const_iterator first, const_iterator last) const {
+    if (first.c == last.c)
+      return last.i - first.i;
+    size_type n = chunks[first.c].size() - first.i + last.i;
+    for (size_t c = first.c + 1; c < last.c; c++)
+      n += chunks[c].size();
+    return n;
+  }
+
+  Value & operator[](const Key &k) {
+    iterator it = lower_bound(k);
+    if (it != end() && !(k < it->first))
+      return it->second;
+    return insert_at(it.c, it.i, value_type(k, Value()))->second;
+  }
+
+  // Inserts (k, v) unless k is already there.  Either way, returns
+  // the entry for k.  The hint is only used to spot appends.
+  iterator emplace_hint(const_iterator hint, const Key &k, const Value &v) {
+    if (hint == end() && (empty() || chunks.back().last() < k))
+      return insert_at(chunks.size(), 0, value_type(k, v));
+    iterator it = lower_bound(k);
+    if (it != end() && !(k < it->first))
+      return it;
+    return insert_at(it.c, it.i, value_type(k, v));
+  }
+
+  template<class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      emplace_hint(end(), first->first, first->second);
+  }
+
+  // Returns the entry after the last one erased.
+  iterator erase(const_iterator first, const_iterator last) {
+    size_t c = first.c;
+    size_t i = first.i;
+    if (first == last)
+      return iterator(this, c, i);
+    if (c == last.c) {
+      chunks[c].erase(i, last.i);
+      count -= last.i - i;
+    } else {
+      count -= distance(first, last);
+      chunks[c].erase(i, chunks[c].size());
+      if (last.c < chunks.size())
+	chunks[last.c].erase(0, last.i);
+      chunks.erase(chunks.begin() + c + 1, chunks.begin() + last.c);
+    }
+    return rejoin(c, i);
+  }
+
+  // Move the entries from first to last out into a map of their own.
+  // Whole chunks in the range change hands without their entries
+  // being touched.
+  flat_map extract(const_iterator first, const_iterator last) {
+    flat_map taken;
+    if (first == last)
+      return taken;
+    size_t c = first.c;
+    size_t i = first.i;
+    taken.count = distance(first, last);
+    count -= taken.count;
+    taken.chunks.push_back(chunk());
+    chunks[c].split(i, taken.chunks.back());
+    if (c == last.c) {
+      chunk rest;
+      taken.chunks.back().split(last.i - i, rest);
+      chunks[c].append(rest);
+    } else {
+      for (size_t d = c + 1; d < last.c; d++)
+	taken.chunks.push_back(std::move(chunks[d]));
+      if (last.c < chunks.size() && last.i > 0) {
+	taken.chunks.push_back(chunk());
+	taken.chunks.back().swap(chunks[last.c]);
+	taken.chunks.back().split(last.i, chunks[last.c]);
+      }
+      chunks.erase(chunks.begin() + c + 1, chunks.begin() + last.c);
+    }
+    rejoin(c, i);
+    return taken;
+  }
+
+  // Move every entry of other, whose keys must all be missing from
+  // this map, into it, and leave other empty.  Each chunk that gets
+  // entries is merged with them in one pass, and split evenly if they
+  // overfill it.  The other chunks are not touched.
+  void merge(flat_map &other) {
+    if (other.empty())
+      return;
+    if (empty()) {
+      std::swap(chunks, other.chunks);
+      std::swap(count, other.count);
+      return;
+    }
+    count += other.count;
+    iterator src = other.begin();
+    while (src != other.end()) {
+      size_t c = std::min(position<iterator>(this, src->first, false).c,
+			  chunks.size() - 1);
+      iterator stop = src;
+      if (c + 1 == chunks.size())
+	stop = other.end();
+      else
+	while (stop != other.end() && stop->first < chunks[c].last())
+	  ++stop;
+      chunks[c].merge(src, stop, other.distance(src, stop));
+      src = stop;
+      size_t total = chunks[c].size();
+      if (total <= FLAT_MAP_CHUNK)
+	continue;
+      size_t pieces = (total + FLAT_MAP_CHUNK - 1) / FLAT_MAP_CHUNK;
+      size_t piece = (total + pieces - 1) / pieces;
+      std::vector<chunk> rest(pieces - 1);
+      for (size_t p = pieces - 1; p > 0; p--)
+	chunks[c].split(p * piece, rest[p - 1]);
+      chunks.insert(chunks.begin() + c + 1,
+		    std::make_move_iterator(rest.begin()),
+		    std::make_move_iterator(rest.end()));
+    }
+    other.clear();
+  }
+
+  iterator erase(const_iterator it) {
+    const_iterator next = it;
+    return erase(it, ++next);
+  }
+
+  size_type erase(const Key &k) {
+    iterator it = find(k);
+    if (it == end())
+      return 0;
+    erase(it);
+    return 1;
+  }
+
+private:
+  // Entries were just removed after entry i - 1 of chunk c.  Fold
+  // chunk c into the next one if both are small, drop it if it is
+  // empty, and return what now follows entry i - 1.
+  iterator rejoin(size_t c, size_t i) {
+    if (c + 1 < chunks.size() &&
+	chunks[c].size() + chunks[c + 1].size() <= 3 * FLAT_MAP_CHUNK / 4) {
+      chunks[c].append(chunks[c + 1]);
+      chunks.erase(chunks.begin() + c + 1);
+    }
+    if (chunks[c].empty())
+      chunks.erase(chunks.begin() + c);
+    else if (i == chunks[c].size()) {
+      c++;
+      i = 0;
+    }
+    return iterator(this, c, i);
+  }
+
+  template<class Iterator, class Map>
+  static Iterator position(Map *m, const Key &k, bool after) {
+    size_t lo = 0;
+    size_t hi = m->chunks.size();
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      const Key &last = m->chunks[mid].last();
+      if (after ? !(k < last) : last < k)
+	lo = mid + 1;
+      else
+	hi = mid;
+    }
+    if (lo == m->chunks.size())
+      return Iterator(m, lo, 0);
+    return Iterator(m, lo, m->chunks[lo].search(k, after));
+  }
+
+  // Insert v before entry i of chunk c (or at the end, for end()).
+  iterator insert_at(size_t c, size_t i, value_type &&v) {
+    if (chunks.empty())
+      chunks.push_back(chunk());
+    if (c == chunks.size()) {
+      c--;
+      i = chunks[c].size();
+    } else if (i == 0 && c > 0 && chunks[c - 1].size() < FLAT_MAP_CHUNK) {
+      // Between two chunks: take the one with room.
+      c--;
+      i = chunks[c].size();
+    }
+    if (chunks[c].size() == FLAT_MAP_CHUNK) {
+      if (c + 1 == chunks.size() && i == FLAT_MAP_CHUNK) {
+	// Appending: leave this chunk full.
+	chunks.push_back(chunk());
+	c++;
+	i = 0;
+      } else {
+	size_t half = FLAT_MAP_CHUNK / 2;
+	chunks.insert(chunks.begin() + c + 1, chunk());
+	chunks[c].split(half, chunks[c + 1]);
+	if (i > half) {
+	  c++;
+	  i -= half;
+	}
+      }
+    }
+    chunks[c].insert(i, std::move(v));
+    count++;
+    return iterator(this, c, i);
+  }
+
+  std::vector<chunk> chunks;
+  size_type count;
+};
+
+#endif // FLAT_MAP_HPP
@@ -0,0 +1,105 @@
+#include "io_stats.hpp"
+#include <cstring>
+#include <iomanip>
+
+latency_histogram::latency_histogram(void)
+{
+  reset();
+}
+
+void latency_histogram::record(uint64_t usecs)
+{
+  int bucket = 0;
+  while (bucket < IO_STATS_BUCKETS - 1 && usecs >= (1ULL << bucket))
+    bucket++;
+  buckets[bucket]++;
+  count++;
+  total_us += usecs;
+  if (usecs > max_us)
+    max_us = usecs;
+}
+
+void latency_histogram::reset(void)
+{
+  count = 0;
+  total_us = 0;
+  max_us = 0;
+  memset(buckets, 0, sizeof(buckets));
+}
+
+//print the non-empty buckets as "<limit_us:count".
+void latency_histogram::print(std::ostream &os) const
+{
+  for (int i = 0; i < IO_STATS_BUCKETS; i++) {
+    if (buckets[i] == 0)
+      continue;
+    if (i == IO_STATS_BUCKETS - 1)
+      os << " >=" << (1ULL << (i - 1)) << ":" << buckets[i];
+    else
+      os << " <" << (1ULL << i) << ":" << buckets[i];
+  }
+}
+
+io_stats::io_stats(void)
+{
+  reset();
+}
+
+void io_stats::record(op o, uint64_t nbytes, uint64_t usecs)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  ops[o]++;
+  bytes[o] += nbytes;
+  latency[o].record(usecs);
+}
+
+void io_stats::reset(void)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  for (int i = 0; i < NUM_OPS; i++) {
+    ops[i] = 0;
+    bytes[i] = 0;
+    latency[i].reset();
+  }
+}
+
+const char * io_stats::op_name(op o)
+{
+  switch (o) {
+  case NODE_READ:    return "node_read";
+  case NODE_WRITE:   return "node_write";
+  case FSYNC:        return "fsync";
+  case FILE_CREATE:  return "file_create";
+  case FILE_UNLINK:  return "file_unlink";
+  case LOG_APPEND:   return "log_append";
+  case LOG_READ:     return "log_read";
+  case LOG_REWRITE:  return "log_rewrite";
+  case LOG_TRUNCATE: return "log_truncate";
+  default:           return "unknown";
+  }
+}
+
+void io_stats::print(std::ostream &os, const std::string &title) const
+{
+  os << "# I/O stats: " << title << std::endl;
+  os << "#   " << std::left << std::setw(13) << "op"
+     << std::right << std::setw(10) << "count"
+     << std::setw(14) << "bytes"
+     << std::setw(12) << "total_us"
+     << std::setw(10) << "avg_us"
+     << std::setw(10) << "max_us"
+     << "  latency histogram (us)" << std::endl;
+  for (int i = 0; i < NUM_OPS; i++) {
+    if (ops[i] == 0)
+      continue;
+    os << "#   " << std::left << std::setw(13) << op_name((op)i)
+       << std::right << std::setw(10) << ops[i]
+       << std::setw(14) << bytes[i]
+       << std::setw(12) << latency[i].total_us
+       << std::setw(10) << latency[i].total_us / ops[i]
+       << std::setw(10) << latency[i].max_us
+       << " ";
+    latency[i].print(os);
+    os << std::endl;
+  }
+}
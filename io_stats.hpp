@@ -0,0 +1,90 @@
+// I/O accounting for the backing stores.  Every store keeps an
+// io_stats recording, per kind of operation, how many were issued,
+// how many bytes they moved and how long they took (as a power-of-two
+// latency histogram).  The test drivers print them on exit.  Recording
+// is thread-safe.
+
+#ifndef IO_STATS_HPP
+#define IO_STATS_HPP
+
+#include <cstdint>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+// Bucket i counts operations that took less than 2^i microseconds
+// (and at least 2^(i-1)).  The last bucket takes everything slower.
+#define IO_STATS_BUCKETS (32)
+
+class latency_histogram {
+public:
+  latency_histogram(void);
+  void record(uint64_t usecs);
+  void reset(void);
+  void print(std::ostream &os) const;
+
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t buckets[IO_STATS_BUCKETS];
+};
+
+class io_stats {
+public:
+  enum op {
+    NODE_READ,
+    NODE_WRITE,
+    FSYNC,
+    FILE_CREATE,
+    FILE_UNLINK,
+    LOG_APPEND,
+    LOG_READ,
+    LOG_REWRITE,
+    LOG_TRUNCATE,
+    NUM_OPS
+  };
+
+  io_stats(void);
+  void record(op o, uint64_t nbytes, uint64_t usecs);
+  void reset(void);
+  // One line per operation that has been issued at least once.
+  void print(std::ostream &os, const std::string &title) const;
+
+  static const char * op_name(op o);
+
+  uint64_t ops[NUM_OPS];
+  uint64_t bytes[NUM_OPS];
+  latency_histogram latency[NUM_OPS];
+
+private:
+  std::mutex lock;
+};
+
+// Times one operation from construction to destruction and records it.
+class io_timer {
+public:
+  io_timer(io_stats &stats, io_stats::op o, uint64_t nbytes = 0)
+    : stats(stats),
+      o(o),
+      nbytes(nbytes),
+      start(std::chrono::steady_clock::now())
+  {}
+
+  ~io_timer(void) {
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    stats.record(o, nbytes,
+		 std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+  }
+
+  // For operations whose size is only known once they are done.
+  void set_bytes(uint64_t n) { nbytes = n; }
+
+private:
+  io_stats &stats;
+  io_stats::op o;
+  uint64_t nbytes;
+  std::chrono::steady_clock::time_point start;
+};
+
+#endif // IO_STATS_HPP
@@ -0,0 +1,226 @@
+#include "key_search.hpp"
+#include <algorithm>
+
+//////////////////////////////////////////////////////
+// Scalar                                           //
+//////////////////////////////////////////////////////
+
+static size_t count_less_scalar(const uint64_t *keys, size_t n, uint64_t k,
+				bool or_equal)
+{
+  const uint64_t *p = or_equal ? std::upper_bound(keys, keys + n, k)
+    : std::lower_bound(keys, keys + n, k);
+  return p - keys;
+}
+
+static size_t count_less_pair_scalar(const uint64_t *keys,
+				     const uint64_t *timestamps, size_t stride,
+				     size_t n, uint64_t k, uint64_t t,
+				     bool or_equal)
+{
+  size_t lo = 0;
+  size_t hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    uint64_t key = keys[mid * stride];
+    uint64_t ts = timestamps[mid * stride];
+    bool before = key < k || (key == k && (or_equal ? ts <= t : ts < t));
+    if (before)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+//////////////////////////////////////////////////////
+// SSE4.2 and AVX2                                  //
+//////////////////////////////////////////////////////
+
+// A branch-free binary search narrows the keys down to a window of
+// at most KEY_SEARCH_WINDOW, and then every key in the window is
+// compared with k, a vector at a time, and the ones before k counted.
+// There are only signed 64-bit comparisons, so keys are compared with
+// their top bits flipped.
+
+#define KEY_SEARCH_WINDOW (16)
+
+// Returns the offset of a window of n keys (n updated) such that every
+// key before it is before k and every key after it is not.
+template<class Before> static size_t narrow(size_t &n, Before before)
+{
+  size_t base = 0;
+  while (n > KEY_SEARCH_WINDOW) {
+    size_t half = n / 2;
+    base = before(base + half) ? base + half : base;
+    n -= half;
+  }
+  return base;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HAVE_KEY_SEARCH_SIMD
+
+__attribute__((target("sse4.2")))
+static size_t count_less_sse42(const uint64_t *keys, size_t n, uint64_t k,
+			       bool or_equal)
+{
+  size_t base = narrow(n, [&](size_t i) {
+      return or_equal ? keys[i] <= k : keys[i] < k;
+    });
+  keys += base;
+  const __m128i flip = _mm_set1_epi64x(INT64_MIN);
+  const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), flip);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(keys + i)), flip);
+    __m128i before = or_equal ?
+      _mm_xor_si128(_mm_cmpgt_epi64(x, kv), _mm_set1_epi64x(-1)) :
+      _mm_cmpgt_epi64(kv, x);
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(before)));
+  }
+  if (i < n)
+    count += or_equal ? keys[i] <= k : keys[i] < k;
+  return base + count;
+}
+
+__attribute__((target("sse4.2")))
+static size_t count_less_pair_sse42(const uint64_t *keys,
+				    const uint64_t *timestamps, size_t stride,
+				    size_t n, uint64_t k, uint64_t t,
+				    bool or_equal)
+{
+  auto before = [&](size_t i) {
+    uint64_t key = keys[i * stride];
+    uint64_t ts = timestamps[i * stride];
+    return key < k || (key == k && (or_equal ? ts <= t : ts < t));
+  };
+  size_t base = narrow(n, before);
+  const __m128i flip = _mm_set1_epi64x(INT64_MIN);
+  const __m128i kv = _mm_xor_si128(_mm_set1_epi64x(k), flip);
+  const __m128i tv = _mm_xor_si128(_mm_set1_epi64x(t), flip);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    const uint64_t *kp = keys + (base + i) * stride;
+    const uint64_t *tp = timestamps + (base + i) * stride;
+    __m128i x = _mm_xor_si128(_mm_set_epi64x(kp[stride], kp[0]), flip);
+    __m128i y = _mm_xor_si128(_mm_set_epi64x(tp[stride], tp[0]), flip);
+    __m128i tie = or_equal ?
+      _mm_xor_si128(_mm_cmpgt_epi64(y, tv), _mm_set1_epi64x(-1)) :
+      _mm_cmpgt_epi64(tv, y);
+    __m128i lt = _mm_or_si128(_mm_cmpgt_epi64(kv, x),
+			      _mm_and_si128(_mm_cmpeq_epi64(x, kv), tie));
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+  }
+  if (i < n)
+    count += before(base + i);
+  return base + count;
+}
+
+__attribute__((target("avx2")))
+static size_t count_less_avx2(const uint64_t *keys, size_t n, uint64_t k,
+			      bool or_equal)
+{
+  size_t base = narrow(n, [&](size_t i) {
+      return or_equal ? keys[i] <= k : keys[i] < k;
+    });
+  keys += base;
+  const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), flip);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(keys + i)), flip);
+    __m256i before = or_equal ?
+      _mm256_xor_si256(_mm256_cmpgt_epi64(x, kv), _mm256_set1_epi64x(-1)) :
+      _mm256_cmpgt_epi64(kv, x);
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(before)));
+  }
+  for (; i < n; i++)
+    count += or_equal ? keys[i] <= k : keys[i] < k;
+  return base + count;
+}
+
+__attribute__((target("avx2")))
+static size_t count_less_pair_avx2(const uint64_t *keys,
+				   const uint64_t *timestamps, size_t stride,
+				   size_t n, uint64_t k, uint64_t t,
+				   bool or_equal)
+{
+  auto before = [&](size_t i) {
+    uint64_t key = keys[i * stride];
+    uint64_t ts = timestamps[i * stride];
+    return key < k || (key == k && (or_equal ? ts <= t : ts < t));
+  };
+  size_t base = narrow(n, before);
+  const __m256i flip = _mm256_set1_epi64x(INT64_MIN);
+  const __m256i kv = _mm256_xor_si256(_mm256_set1_epi64x(k), flip);
+  const __m256i tv = _mm256_xor_si256(_mm256_set1_epi64x(t), flip);
+  const __m256i lanes = _mm256_set_epi64x(3 * stride, 2 * stride, stride, 0);
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const long long *kp = (const long long *)(keys + (base + i) * stride);
+    const long long *tp = (const long long *)(timestamps + (base + i) * stride);
+    __m256i x = _mm256_xor_si256(_mm256_i64gather_epi64(kp, lanes, 8), flip);
+    __m256i y = _mm256_xor_si256(_mm256_i64gather_epi64(tp, lanes, 8), flip);
+    __m256i tie = or_equal ?
+      _mm256_xor_si256(_mm256_cmpgt_epi64(y, tv), _mm256_set1_epi64x(-1)) :
+      _mm256_cmpgt_epi64(tv, y);
+    __m256i lt = _mm256_or_si256(_mm256_cmpgt_epi64(kv, x),
+				 _mm256_and_si256(_mm256_cmpeq_epi64(x, kv), tie));
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+  }
+  for (; i < n; i++)
+    count += before(base + i);
+  return base + count;
+}
+#endif
+
+//////////////////////////////////////////////////////
+// Dispatch                                         //
+//////////////////////////////////////////////////////
+
+typedef size_t (*count_less_fn)(const uint64_t *, size_t, uint64_t, bool);
+typedef size_t (*count_less_pair_fn)(const uint64_t *, const uint64_t *,
+				     size_t, size_t, uint64_t, uint64_t, bool);
+
+static count_less_fn pick_count_less(void)
+{
+#ifdef HAVE_KEY_SEARCH_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return count_less_avx2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return count_less_sse42;
+#endif
+  return count_less_scalar;
+}
+
+static count_less_pair_fn pick_count_less_pair(void)
+{
+#ifdef HAVE_KEY_SEARCH_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return count_less_pair_avx2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return count_less_pair_sse42;
+#endif
+  return count_less_pair_scalar;
+}
+
+size_t count_less_u64(const uint64_t *keys, size_t n, uint64_t k,
+		      bool or_equal)
+{
+  static const count_less_fn fn = pick_count_less();
+  return fn(keys, n, k, or_equal);
+}
+
+size_t count_less_u64_pair(const uint64_t *keys, const uint64_t *timestamps,
+			   size_t stride, size_t n, uint64_t k, uint64_t t,
+			   bool or_equal)
+{
+  static const count_less_pair_fn fn = pick_count_less_pair();
+  return fn(keys, timestamps, stride, n, k, t, or_equal);
+}
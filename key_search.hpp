@@ -0,0 +1,27 @@
+// Searches of short sorted arrays of 64-bit integer keys, as kept by
+// flat_maps keyed on uint64_t or MessageKey<uint64_t> (see
+// flat_map.hpp and betree.hpp).  On x86-64 they compare several keys
+// at once with AVX2 or SSE4.2, whichever the CPU has, and otherwise
+// fall back to a binary search.
+
+#ifndef KEY_SEARCH_HPP
+#define KEY_SEARCH_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// The number of the n sorted keys that are less than k, or, if
+// or_equal, not greater than k.  That is, the index lower_bound (or
+// upper_bound) would return.
+size_t count_less_u64(const uint64_t *keys, size_t n, uint64_t k,
+		      bool or_equal);
+
+// The same for n (key, timestamp) pairs, sorted by key and then
+// timestamp.  Pair i's key is keys[i * stride] and its timestamp
+// timestamps[i * stride], so that they can be read in place from an
+// array of structs.
+size_t count_less_u64_pair(const uint64_t *keys, const uint64_t *timestamps,
+			   size_t stride, size_t n, uint64_t k, uint64_t t,
+			   bool or_equal);
+
+#endif // KEY_SEARCH_HPP
@@ -3,32 +3,110 @@
 
 //Methods to serialize/deserialize different kinds of objects.
 //You shouldn't need to touch these.
+
+//binary integers are little-endian, whatever the host.
+void write_le(std::iostream &fs, uint64_t x, int width)
+{
+  char buf[8];
+  if (SERIAL_HOST_LE)
+    memcpy(buf, &x, 8);
+  else
+    for (int i = 0; i < width; i++)
+      buf[i] = (char)(x >> (8 * i));
+  fs.write(buf, width);
+  assert(fs.good());
+}
+
+uint64_t read_le(std::iostream &fs, int width)
+{
+  char buf[8];
+  fs.read(buf, width);
+  assert(fs.good());
+  return load_le(buf, width);
+}
+
+uint64_t load_le(const char *p, int width)
+{
+  uint64_t x = 0;
+  if (SERIAL_HOST_LE) {
+    memcpy(&x, p, width);
+    return x;
+  }
+  for (int i = 0; i < width; i++)
+    x |= (uint64_t)(unsigned char)p[i] << (8 * i);
+  return x;
+}
+
+void serialize(std::iostream &fs, serialization_context &context, uint32_t x)
+{
+  if (context.binary()) {
+    write_le(fs, x, 4);
+    return;
+  }
+  fs << x << " ";
+  assert(fs.good());
+}
+
+void deserialize(std::iostream &fs, serialization_context &context, uint32_t &x)
+{
+  if (context.binary()) {
+    x = read_le(fs, 4);
+    return;
+  }
+  fs >> x;
+  assert(fs.good());
+}
+
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x)
 {
+  if (context.binary()) {
+    write_le(fs, x, 8);
+    return;
+  }
   fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x)
 {
+  if (context.binary()) {
+    x = read_le(fs, 8);
+    return;
+  }
   fs >> x;
   assert(fs.good());
 }
 
 void serialize(std::iostream &fs, serialization_context &context, int64_t x)
 {
+  if (context.binary()) {
+    write_le(fs, (uint64_t)x, 8);
+    return;
+  }
   fs << x << " ";
   assert(fs.good());
 }
 
 void deserialize(std::iostream &fs, serialization_context &context, int64_t &x)
 {
+  if (context.binary()) {
+    x = (int64_t)read_le(fs, 8);
+    return;
+  }
   fs >> x;
   assert(fs.good());
 }
 
+//binary strings are a 32-bit length and the bytes.
 void serialize(std::iostream &fs, serialization_context &context, std::string x)
 {
+  if (context.binary()) {
+    assert(x.size() <= UINT32_MAX);
+    write_le(fs, x.size(), 4);
+    fs.write(x.data(), x.size());
+    assert(fs.good());
+    return;
+  }
   fs << x.size() << ",";
   assert(fs.good());
   fs.write(x.data(), x.size());
@@ -38,139 +116,645 @@ void serialize(std::iostream &fs, serialization_context &context, std::string x)
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x)
 {
   size_t length;
-  char comma;
-  fs >> length >> comma;
+  if (context.binary()) {
+    length = read_le(fs, 4);
+  } else {
+    char comma;
+    fs >> length >> comma;
+    assert(fs.good());
+  }
+  x.resize(length);
+  if (length > 0)
+    fs.read(&x[0], length);
   assert(fs.good());
-  char *buf = new char[length];
-  assert(buf);
-  fs.read(buf, length);
+}
+
+void write_varint(std::iostream &fs, uint64_t x)
+{
+  char buf[10];
+  int n = 0;
+  while (x >= 0x80) {
+    buf[n++] = (char)(x | 0x80);
+    x >>= 7;
+  }
+  buf[n++] = (char)x;
+  fs.write(buf, n);
   assert(fs.good());
-  x = std::string(buf, length);
-  delete buf;
 }
 
-bool swap_space::cmp_by_last_access(swap_space::object *a, swap_space::object *b) {
-  return a->last_access < b->last_access;
+uint64_t read_varint(std::iostream &fs)
+{
+  uint64_t x = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int c = fs.get();
+    assert(fs.good());
+    x |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      break;
+  }
+  return x;
+}
+
+static uint64_t zigzag(int64_t x)
+{
+  return ((uint64_t)x << 1) ^ (uint64_t)(x >> 63);
+}
+
+static int64_t unzigzag(uint64_t x)
+{
+  return (int64_t)(x >> 1) ^ -(int64_t)(x & 1);
+}
+
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     uint64_t prev, uint64_t x)
+{
+  write_varint(fs, zigzag((int64_t)(x - prev)));
+}
+
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       uint64_t &x)
+{
+  x += (uint64_t)unzigzag(read_varint(fs));
+}
+
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     int64_t prev, int64_t x)
+{
+  write_varint(fs, zigzag((int64_t)((uint64_t)x - (uint64_t)prev)));
 }
 
-swap_space::swap_space(backing_store *bs, uint64_t n) :
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       int64_t &x)
+{
+  x = (int64_t)((uint64_t)x + (uint64_t)unzigzag(read_varint(fs)));
+}
+
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     const std::string &prev, const std::string &x)
+{
+  size_t shared = 0;
+  while (shared < prev.size() && shared < x.size() && prev[shared] == x[shared])
+    shared++;
+  write_varint(fs, shared);
+  write_varint(fs, x.size() - shared);
+  fs.write(x.data() + shared, x.size() - shared);
+  assert(fs.good());
+}
+
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       std::string &x)
+{
+  uint64_t shared = read_varint(fs);
+  uint64_t rest = read_varint(fs);
+  assert(shared <= x.size());
+  x.resize(shared + rest);
+  if (rest > 0)
+    fs.read(&x[shared], rest);
+  assert(fs.good());
+}
+
+bool parse_serialization_format_name(const std::string &name, uint8_t &format)
+{
+  if (name == "text")
+    format = SERIAL_TEXT;
+  else if (name == "binary")
+    format = SERIAL_BINARY;
+  else if (name == "compact")
+    format = SERIAL_COMPACT;
+  else
+    return false;
+  return true;
+}
+
+swap_space::shard::shard(void) :
+  next_slot(0),
+  policy(NULL),
+  resident(0),
+  tier_bytes(0),
+  pending_bytes(0)
+{}
+
+swap_space::swap_space(backing_store *bs, uint64_t n, eviction_policy *policy) :
   backstore(bs),
+  codec(CODEC_NONE),
+  format(SERIAL_TEXT),
+  headerless_nodes(false),
+  next_alloc(0),
+  used_shards(1),
   max_in_memory_objects(n),
-  objects(),
-  lru_pqueue(cmp_by_last_access)
+  current_in_memory_objects(0),
+  max_in_memory_bytes(0),
+  current_in_memory_bytes(0),
+  current_internal_objects(0),
+  current_internal_bytes(0),
+  dirty_objects(0),
+  max_tier_bytes(0),
+  tier_bytes(0),
+  flusher_running(false)
 {
+  static_assert(SWAP_SPACE_SHARDS <= 64, "shards are tracked in a uint64_t mask");
   rootDir = bs->getRootDir();
+  // Every shard gets a policy of the same kind, which only sees that
+  // shard's objects.
+  if (policy == NULL)
+    policy = make_eviction_policy("lru");
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++)
+    shards[i].policy = i == 0 ? policy : make_eviction_policy(policy->name());
+  size_shards(n);
+  // Id 0 is the null pointer and is never used.
+  shards[0].next_slot = 1;
 }
 
-//construct a new object. Called by ss->allocate() via pointer<Referent> construction
-//Does not insert into objects table - that's handled by pointer<Referent>()
-swap_space::object::object(swap_space *sspace, serializable * tgt) {
-  target = tgt;
-  id = sspace->next_id++;
+swap_space::~swap_space(void)
+{
+  stop_prefetchers();
+  stop_flusher();
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    delete shards[i].policy;
+    for (auto it = shards[i].objects.begin(); it != shards[i].objects.end(); ++it)
+      delete [] *it;
+  }
+}
+
+//an empty slot of the object table.
+swap_space::object::object(void) {
+  target = NULL;
+  id = 0;
   version = 0;
+  refcount = 0;
+  loaded = false;
+  accessed = false;
+  live = false;
+  loading = false;
   is_leaf = false;
-  refcount = 1;
-  last_access = sspace->next_access_time++;
-  target_is_dirty = true;
-  pincount = 0;
+  footprint = 0;
+  serialized_size = 0;
+  in_tier = false;
+  in_dirty_list = false;
+}
+
+//the live object with this id, or NULL.  Called with its shard's lock
+//held.
+swap_space::object * swap_space::lookup(uint64_t id)
+{
+  shard &sh = shard_of(id);
+  uint64_t slot = id / SWAP_SPACE_SHARDS;
+  if (slot / OBJECT_TABLE_CHUNK >= sh.objects.size())
+    return NULL;
+  object *obj = &sh.objects[slot / OBJECT_TABLE_CHUNK][slot % OBJECT_TABLE_CHUNK];
+  return obj->live ? obj : NULL;
+}
+
+//construct a new object in shard sh, whose lock is held. Called by
+//ss->allocate() via pointer<Referent> construction, and during
+//recovery, which asks for specific ids.  Otherwise the shard's most
+//recently freed id is reused, and the new object's versions continue
+//from the last one written under that id.
+swap_space::object * swap_space::new_object(shard &sh, serializable *tgt,
+					    uint64_t id)
+{
+  if (id == 0) {
+    if (!sh.free_ids.empty()) {
+      id = sh.free_ids.back();
+      sh.free_ids.pop_back();
+    } else {
+      id = sh.next_slot++ * SWAP_SPACE_SHARDS + (&sh - shards);
+    }
+  }
+  assert(&shard_of(id) == &sh);
+  uint64_t slot = id / SWAP_SPACE_SHARDS;
+  while (slot / OBJECT_TABLE_CHUNK >= sh.objects.size())
+    sh.objects.push_back(new object[OBJECT_TABLE_CHUNK]);
+  object *obj = &sh.objects[slot / OBJECT_TABLE_CHUNK][slot % OBJECT_TABLE_CHUNK];
+  assert(!obj->live && obj->pincount == 0 && obj->policy_in == NULL);
+  obj->target = tgt;
+  obj->id = id;
+  obj->refcount = 1;
+  obj->loaded = false;
+  obj->accessed = false;
+  obj->live = true;
+  obj->is_leaf = false;
+  obj->target_is_dirty = true;
+  obj->resident = false;
+  obj->referenced = false;
+  obj->internal = false;
+  obj->footprint = 0;
+  obj->serialized_size = 0;
+  assert(!obj->in_tier && !obj->in_dirty_list);
+  return obj;
+}
+
+//return a collected object's slot to the table.  If the flusher is
+//writing it out right now, it gets freed once the write is done, so
+//that the id is not reused under it.
+void swap_space::free_object(swap_space::object *obj)
+{
+  assert(obj->live && obj->refcount == 0);
+  obj->live = false;
+  obj->target = NULL;
+  obj->resident = false;
+  if (obj->pincount == 0)
+    shard_of(obj->id).free_ids.push_back(obj->id);
+}
+
+//obj's target was just put in memory.  Called with its shard's lock
+//held.
+void swap_space::make_resident(swap_space::object *obj)
+{
+  shard &sh = shard_of(obj->id);
+  obj->resident = true;
+  obj->loaded = true;
+  sh.policy->on_insert(obj);
+  sh.resident++;
+  current_in_memory_objects++;
+  update_footprint(obj);
+}
+
+//obj's target is about to leave memory.  The caller deletes it.
+void swap_space::drop_resident(swap_space::object *obj)
+{
+  obj->loaded = false;
+  obj->resident = false;
+  shard_of(obj->id).resident--;
+  current_in_memory_objects--;
+  drop_footprint(obj);
+}
+
+//obj's last pin just went.  Tell the policy about the accesses made
+//through it, and that obj can be evicted again.
+void swap_space::unpinned(swap_space::object *obj)
+{
+  eviction_policy *policy = shard_of(obj->id).policy;
+  // It may have grown or shrunk while pinned.
+  update_footprint(obj);
+  if (obj->accessed.exchange(false) && obj->resident)
+    policy->on_access(obj);
+  policy->on_unpin(obj);
+}
+
+//spread new objects over as many shards as a cache of n objects can
+//give SWAP_SPACE_SHARD_MIN_OBJECTS each, and size every shard's policy
+//for its share.  Objects already in other shards stay there.
+void swap_space::size_shards(uint64_t n)
+{
+  uint64_t used = n / SWAP_SPACE_SHARD_MIN_OBJECTS;
+  used = std::max<uint64_t>(1, std::min<uint64_t>(used, SWAP_SPACE_SHARDS));
+  used_shards = used;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    shards[i].policy->set_capacity(n / used);
+  }
 }
 
 //set # of items that can live in ss.
 void swap_space::set_cache_size(uint64_t sz) {
   assert(sz > 0);
   max_in_memory_objects = sz;
+  size_shards(sz);
+  maybe_evict_something();
+}
+
+void swap_space::set_compression(uint8_t c) {
+  assert(c == CODEC_NONE || get_compressor(c) != NULL);
+  codec = c;
+}
+
+void swap_space::set_serialization_format(uint8_t f)
+{
+  assert(f == SERIAL_TEXT || f == SERIAL_BINARY || f == SERIAL_COMPACT);
+  format = f;
+}
+
+void swap_space::set_headerless_nodes(bool allow)
+{
+  headerless_nodes = allow;
+}
+
+void swap_space::set_prefer_clean_victims(bool prefer)
+{
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    shards[i].policy->set_prefer_clean(prefer);
+  }
+}
+
+void swap_space::set_cache_bytes(uint64_t sz)
+{
+  max_in_memory_bytes = sz;
   maybe_evict_something();
 }
 
+void swap_space::set_internal_share(double share)
+{
+  assert(share >= 0 && share <= 1);
+  internal_share = share;
+}
+
+//re-weigh a resident object, and see whether it is internal.
+void swap_space::update_footprint(swap_space::object *obj)
+{
+  if (obj->target == NULL)
+    return;
+  uint64_t fp = obj->target->memory_footprint();
+  drop_footprint(obj);
+  obj->footprint = fp;
+  obj->internal = !obj->target->is_leaf();
+  current_in_memory_bytes += fp;
+  if (obj->internal) {
+    current_internal_objects++;
+    current_internal_bytes += fp;
+  }
+}
+
+//take an object's weight off the books.
+void swap_space::drop_footprint(swap_space::object *obj)
+{
+  current_in_memory_bytes -= obj->footprint;
+  if (obj->internal) {
+    current_internal_objects--;
+    current_internal_bytes -= obj->footprint;
+    obj->internal = false;
+  }
+  obj->footprint = 0;
+}
+
+void swap_space::set_compressed_cache_bytes(uint64_t sz)
+{
+  max_tier_bytes = sz;
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    tier_spill(shards[i]);
+    flush_pending_writes(shards[i]);
+  }
+}
+
+bool swap_space::over_budget(void) const
+{
+  uint64_t max_bytes = max_in_memory_bytes;
+  return current_in_memory_objects > max_in_memory_objects ||
+    (max_bytes > 0 && current_in_memory_bytes > max_bytes);
+}
+
+//whether internal objects are within their reserved share.
+bool swap_space::internal_protected(void) const
+{
+  uint64_t max_bytes = max_in_memory_bytes;
+  return internal_share > 0 &&
+    current_internal_objects <= internal_share * max_in_memory_objects &&
+    (max_bytes == 0 || current_internal_bytes <= internal_share * max_bytes);
+}
+
+//serialize an object into raw, replacing what was there.  Unless it
+//stays in memory (evicting == false), this calls _serialize on all the
+//pointers in this object, which keeps refcounts right later on when we
+//delete them all.
+node_summary swap_space::serialize_object(swap_space::object *obj,
+					  std::string &raw, uint8_t fmt,
+					  bool evicting)
+{
+  serialization_context ctxt(*this, fmt, evicting);
+  ctxt.id = obj->id;
+  ctxt.version = obj->version + 1;
+  raw.clear();
+  raw.reserve(obj->serialized_size);
+  {
+    string_buffer sb(raw);
+    std::iostream out(&sb);
+    serialize(out, ctxt, *obj->target);
+    assert(out.good());
+  }
+  obj->is_leaf = ctxt.is_leaf;
+  obj->serialized_size = raw.size();
+  return ctxt.summary;
+}
+
+//hand out an empty buffer, from the pool if there is one.
+void swap_space::take_buffer(std::string &buf)
+{
+  std::lock_guard<std::mutex> guard(buffer_lock);
+  if (buffer_pool.empty()) {
+    std::string().swap(buf);
+    return;
+  }
+  buf.swap(buffer_pool.back());
+  buffer_pool.pop_back();
+  buf.clear();
+}
+
+//return a buffer that is no longer needed to the pool.
+void swap_space::give_buffer(std::string &buf)
+{
+  std::lock_guard<std::mutex> guard(buffer_lock);
+  if (buffer_pool.size() < BUFFER_POOL_MAX) {
+    buffer_pool.push_back(std::string());
+    buffer_pool.back().swap(buf);
+  }
+}
+
 //write an object that lives on disk back to disk
 //only triggers a write if the object is "dirty" (target_is_dirty == true)
+//The write itself is queued on its shard's pending_writes; the object
+//keeps pointing at its old version until flush_pending_writes() has
+//made the batch durable.
 void swap_space::write_back(swap_space::object *obj)
 {
-  assert(objects.count(obj->id) > 0);
+  assert(obj->live);
 
   debug(std::cout << "Writing back " << obj->id
-	<< " (" << obj->target << ") "
-	<< "with last access time " << obj->last_access << std::endl);
-
-  // This calls _serialize on all the pointers in this object,
-  // which keeps refcounts right later on when we delete them all.
-  // In the future, we may also use this to implement in-memory
-  // evictions, i.e. where we first "evict" an object by
-  // compressing it and keeping the compressed version in memory.
-  serialization_context ctxt(*this);
-  std::stringstream sstream;
-  serialize(sstream, ctxt, *obj->target);
-  obj->is_leaf = ctxt.is_leaf;
+	<< " (" << obj->target << ")" << std::endl);
+
+  shard &sh = shard_of(obj->id);
+  uint8_t fmt = format;
+  node_summary summary = serialize_object(obj, sh.serialize_scratch, fmt);
 
   if (obj->target_is_dirty) {
-    std::string buffer = sstream.str();
-    //modification - ss now controls BSID - split into unique id and version.
-    //version increments linearly based uniquely on this version counter.
+    std::string encoded;
+    take_buffer(encoded);
+    encode_node(sh.serialize_scratch.data(), sh.serialize_scratch.length(),
+		codec, fmt, summary, encoded);
+    queue_write(obj, encoded);
+  }
+}
 
-    uint64_t new_version_id = obj->version+1;
+//queue the next version of obj, taking the contents of encoded.
+void swap_space::queue_write(swap_space::object *obj, std::string &encoded)
+{
+  //modification - ss now controls BSID - split into unique id and version.
+  //version increments linearly based uniquely on this version counter.
+  shard &sh = shard_of(obj->id);
+  sh.pending_writes.push_back(pending_write());
+  pending_write &pw = sh.pending_writes.back();
+  pw.obj = obj;
+  pw.version = obj->version + 1;
+  pw.buffer.swap(encoded);
+  sh.pending_bytes += pw.buffer.size();
+}
 
-    backstore->allocate(obj->id, new_version_id);
-    std::iostream *out = backstore->get(obj->id, new_version_id);
-    out->write(buffer.data(), buffer.length());
-    backstore->put(out);
+//write every version queued in a shard as one batch, then switch the
+//objects over to their new versions.
+void swap_space::flush_pending_writes(shard &sh)
+{
+  if (sh.pending_writes.empty())
+    return;
 
+  std::vector<backing_store::batch_write> batch;
+  batch.reserve(sh.pending_writes.size());
+  for (auto it = sh.pending_writes.begin(); it != sh.pending_writes.end(); ++it) {
+    backing_store::batch_write w = { it->obj->id, it->version,
+				     it->buffer.data(), it->buffer.size() };
+    batch.push_back(w);
+  }
+  backstore->write_batch(batch);
+
+  for (auto it = sh.pending_writes.begin(); it != sh.pending_writes.end(); ++it) {
     //version 0 is the flag that the object exists only in memory.
     /*
-    if (obj->version > 0) {
-      backstore->deallocate(obj->id, obj->version);
+    if (it->obj->version > 0) {
+      backstore->deallocate(it->obj->id, it->obj->version);
     }
     */
-    obj->version = new_version_id;
-    obj->target_is_dirty = false;
+    it->obj->version = it->version;
+    it->obj->target_is_dirty = false;
+    dirty_list_remove(it->obj);
+    give_buffer(it->buffer);
   }
+  sh.pending_writes.clear();
+  sh.pending_bytes = 0;
 }
 
+//park an evicted object, compressed, in its shard's tier.  Dirty
+//objects stay dirty: the backing store only sees them if they spill.
+void swap_space::tier_insert(swap_space::object *obj)
+{
+  assert(!obj->in_tier);
+  debug(std::cout << "Compressing " << obj->id << std::endl);
+  shard &sh = shard_of(obj->id);
+  uint8_t fmt = format;
+  node_summary summary = serialize_object(obj, sh.serialize_scratch, fmt);
+  // The tier is only worth having if it compresses.
+  uint8_t c = codec;
+  encode_node(sh.serialize_scratch.data(), sh.serialize_scratch.length(),
+	      c != CODEC_NONE ? c : CODEC_LZ, fmt, summary, obj->compressed);
+  obj->in_tier = true;
+  obj->tier_pos = sh.tier.insert(sh.tier.end(), obj);
+  sh.tier_bytes += obj->compressed.size();
+  tier_bytes += obj->compressed.size();
+}
 
-//attempt to evict an unused object from the swap space
-//objects in swap space are referenced in a priority queue
-//pull objects with low counts first to try and find an object with pincount 0.
-void swap_space::maybe_evict_something(void)
+void swap_space::tier_remove(swap_space::object *obj)
 {
-  while (current_in_memory_objects > max_in_memory_objects) {
-    object *obj = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); ++it)
-      if ((*it)->pincount == 0) {
-	obj = *it;
-	break;
-      }
-    if (obj == NULL)
-      return;
-    lru_pqueue.erase(obj);
+  assert(obj->in_tier);
+  shard &sh = shard_of(obj->id);
+  sh.tier_bytes -= obj->compressed.size();
+  tier_bytes -= obj->compressed.size();
+  sh.tier.erase(obj->tier_pos);
+  obj->in_tier = false;
+  std::string().swap(obj->compressed);
+}
 
+//push the oldest objects out of a shard's tier until it fits in its
+//share, queueing the dirty ones for write-back.  Their encoded form is
+//already what goes to disk.
+void swap_space::tier_spill(shard &sh)
+{
+  uint64_t limit = max_tier_bytes / used_shards;
+  while (sh.tier_bytes > limit && !sh.tier.empty()) {
+    object *obj = sh.tier.front();
+    std::string encoded;
+    if (obj->target_is_dirty)
+      encoded.swap(obj->compressed);
+    sh.tier_bytes -= encoded.size();
+    tier_bytes -= encoded.size();
+    tier_remove(obj);
+    if (obj->target_is_dirty)
+      queue_write(obj, encoded);
+    if (sh.pending_bytes >= WRITE_BATCH_MAX_BYTES)
+      flush_pending_writes(sh);
+  }
+}
+
+//write back an unpinned object and drop it from memory.  Called with
+//its shard's lock held.
+void swap_space::evict(swap_space::object *obj)
+{
+  shard &sh = shard_of(obj->id);
+  if (max_tier_bytes > 0)
+    tier_insert(obj);
+  else
     write_back(obj);
-    
-    delete obj->target;
-    obj->target = NULL;
-    current_in_memory_objects--;
+  dirty_list_remove(obj);
+  drop_resident(obj);
+  delete obj->target;
+  obj->target = NULL;
+  sh.policy->on_evict(obj);
+  tier_spill(sh);
+  if (sh.pending_bytes >= WRITE_BATCH_MAX_BYTES)
+    flush_pending_writes(sh);
+}
+
+//evict unpinned objects until the swap_space is within its budgets.
+//Each victim comes from the shard with the most resident objects, and
+//is picked by that shard's policy.  Internal objects within their
+//reserved share are only evicted once no shard has anything else to
+//give.  Called with no shard lock held.
+void swap_space::maybe_evict_something(void)
+{
+  uint64_t exhausted = 0;
+  bool may_protect = true;
+  while (over_budget()) {
+    int fullest = -1;
+    for (int i = 0; i < SWAP_SPACE_SHARDS; i++)
+      if (!(exhausted & (1ULL << i)) && shards[i].resident > 0 &&
+	  (fullest < 0 || shards[i].resident > shards[fullest].resident))
+	fullest = i;
+    if (fullest < 0) {
+      if (!may_protect || exhausted == 0)
+	break;
+      may_protect = false;
+      exhausted = 0;
+      continue;
+    }
+    shard &sh = shards[fullest];
+    std::lock_guard<std::mutex> guard(sh.lock);
+    sh.policy->set_protect_internal(may_protect && internal_protected());
+    cache_entry *victim = sh.policy->choose_victim();
+    if (victim == NULL) {
+      exhausted |= 1ULL << fullest;
+      continue;
+    }
+    evict(static_cast<object *>(victim));
+    flush_pending_writes(sh);
   }
 }
 
+//write back and drop every unpinned object.
 void swap_space::flushAllModifiedPagesIntoDisk(void) {
-  auto s = lru_pqueue.size();
-  debug(std::cout << "lru_pqueue.size():" << s << std::endl);
+  // Keep the flusher out, so that every version is final once we
+  // return.
+  std::lock_guard<std::mutex> fguard(flush_lock);
   debug(std::cout << "current_in_memory_objects:" << current_in_memory_objects << std::endl);
-  while (current_in_memory_objects > 0) {
-    object *objToDel = NULL;
-    for (auto it = lru_pqueue.begin(); it != lru_pqueue.end(); it++) {
-      if ((*it)->pincount != 0) {
-        debug(std::cout << "There is object need to be unpinned, pincount:" << (*it)->pincount
-	                    << "id:" << (*it)->id << std::endl);
-      } else {
-        debug(std::cout << "pincount:" << (*it)->pincount	<< "id:" << (*it)->id << std::endl);
-        objToDel = *it;
-        break;
-      }
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    shard &sh = shards[i];
+    std::lock_guard<std::mutex> guard(sh.lock);
+    sh.policy->set_protect_internal(false);
+    cache_entry *victim;
+    while ((victim = sh.policy->choose_victim()) != NULL) {
+      debug(std::cout << "pincount:" << victim->pincount << "id:"
+	    << static_cast<object *>(victim)->id << std::endl);
+      evict(static_cast<object *>(victim));
+    }
+    // Objects in the compressed tier stay there, but their latest
+    // versions have to be on disk too.
+    for (auto it = sh.tier.begin(); it != sh.tier.end(); ++it) {
+      object *obj = *it;
+      if (!obj->target_is_dirty)
+	continue;
+      std::string encoded(obj->compressed);
+      queue_write(obj, encoded);
+      if (sh.pending_bytes >= WRITE_BATCH_MAX_BYTES)
+	flush_pending_writes(sh);
     }
-    lru_pqueue.erase(objToDel);
-    write_back(objToDel);
-    delete objToDel->target;
-    objToDel->target = NULL;
-    current_in_memory_objects--;
+    flush_pending_writes(sh);
   }
 }
 
@@ -178,11 +762,37 @@ std::string swap_space::getRootDir(void) {
   return rootDir;
 }
 
+void swap_space::read_version(uint64_t id, uint64_t version,
+			      std::string &raw, uint8_t &raw_format)
+{
+  std::string stored;
+  backstore->read(id, version, stored);
+  if (!decode_node(stored, raw, raw_format, headerless_nodes))
+    corrupt_version(id, version, "backing store");
+}
+
+// A stored version failed its header or checksum check.  Going on
+// would deserialize garbage, so stop here even in builds without
+// asserts.
+void swap_space::corrupt_version(uint64_t id, uint64_t version,
+				 const char *source)
+{
+  std::cerr << "Object " << id << " version " << version << " in the "
+	    << source << " is damaged" << std::endl;
+  abort();
+}
+
 void swap_space::getIdAndVerOfAllNodes(std::vector<std::pair<u_int64_t, \
       u_int64_t>> &idAndVers) {
-  for (auto it = objects.begin(); it != objects.end(); it++) {
-    if (it->second->refcount > 0) {
-      idAndVers.push_back({it->first, it->second->version});
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    shard &sh = shards[i];
+    std::lock_guard<std::mutex> guard(sh.lock);
+    for (auto it = sh.objects.begin(); it != sh.objects.end(); it++) {
+      for (object *obj = *it; obj != *it + OBJECT_TABLE_CHUNK; obj++) {
+        if (obj->live && obj->refcount > 0) {
+          idAndVers.push_back({obj->id, obj->version});
+        }
+      }
     }
   }
 }
@@ -191,14 +801,296 @@ void swap_space::setObjectsForRecovery(std::unordered_map<uint64_t,\
       uint64_t> &objsMap){
   uint64_t maxId = 0;
   for (auto it = objsMap.begin(); it != objsMap.end(); it++) {
-    object *obj = new object(this, NULL);
-    obj->id = it->first;
-    obj->target_is_dirty = true;
+    shard &sh = shard_of(it->first);
+    std::lock_guard<std::mutex> guard(sh.lock);
+    assert(sh.free_ids.empty());
+    object *obj = new_object(sh, NULL, it->first);
     obj->version = it->second;
-    objects[it->first] = obj;
     if (it->first > maxId) {
       maxId = it->first;
     }
   }
-  next_id = maxId + 1;
-}
\ No newline at end of file
+  // Ids below maxId that are not in use are left alone: their old
+  // versions are not known.
+  for (int i = 0; i < SWAP_SPACE_SHARDS; i++) {
+    std::lock_guard<std::mutex> guard(shards[i].lock);
+    shards[i].next_slot = maxId / SWAP_SPACE_SHARDS + 1;
+  }
+}
+
+void swap_space::dirty_list_add(swap_space::object *obj)
+{
+  assert(obj->target != NULL && obj->target_is_dirty);
+  if (obj->in_dirty_list)
+    return;
+  shard &sh = shard_of(obj->id);
+  obj->dirty_pos = sh.dirty_list.insert(sh.dirty_list.end(), obj);
+  obj->in_dirty_list = true;
+  uint64_t dirty = ++dirty_objects;
+  if (flusher_running &&
+      dirty > dirty_watermark * current_in_memory_objects)
+    flusher_wakeup.notify_one();
+}
+
+void swap_space::dirty_list_remove(swap_space::object *obj)
+{
+  if (!obj->in_dirty_list)
+    return;
+  shard_of(obj->id).dirty_list.erase(obj->dirty_pos);
+  obj->in_dirty_list = false;
+  dirty_objects--;
+}
+
+void swap_space::start_flusher(double watermark, unsigned interval_ms)
+{
+  std::lock_guard<std::mutex> guard(flusher_lock);
+  assert(!flusher_running);
+  assert(watermark >= 0 && watermark <= 1);
+  dirty_watermark = watermark;
+  flusher_interval_ms = interval_ms;
+  flusher_stopping = false;
+  flusher_running = true;
+  flusher = std::thread(&swap_space::flusher_main, this);
+}
+
+void swap_space::stop_flusher(void)
+{
+  {
+    std::lock_guard<std::mutex> guard(flusher_lock);
+    if (!flusher_running)
+      return;
+    flusher_stopping = true;
+    flusher_wakeup.notify_one();
+  }
+  flusher.join();
+  flusher_running = false;
+}
+
+//the flusher thread.  It runs a round whenever more than the
+//watermark of the objects in memory are dirty, and otherwise sleeps.
+void swap_space::flusher_main(void)
+{
+  std::unique_lock<std::mutex> guard(flusher_lock);
+  while (!flusher_stopping) {
+    uint64_t high = dirty_watermark * current_in_memory_objects;
+    bool wrote = false;
+    if (dirty_objects > high) {
+      guard.unlock();
+      wrote = flush_round(high / 2);
+      guard.lock();
+    }
+    // If everything dirty is pinned, try again later.
+    if (!wrote && !flusher_stopping)
+      flusher_wakeup.wait_for(guard, std::chrono::milliseconds(flusher_interval_ms));
+  }
+}
+
+//snapshot a batch of unpinned dirty objects, oldest dirtied first in
+//each shard, until at most low are dirty, and write them back.  Each
+//shard's part is taken under its lock.  The write happens with no
+//shard lock held, and the objects stay pinned until their new
+//versions are durable, so they cannot be evicted meanwhile.  Returns
+//whether there was anything to write.
+bool swap_space::flush_round(uint64_t low)
+{
+  struct snapshot {
+    object *obj;
+    uint64_t version;
+    std::string buffer;
+    std::string encoded;
+    node_summary summary;
+  };
+
+  std::lock_guard<std::mutex> fguard(flush_lock);
+  uint8_t batch_codec = codec;
+  uint8_t batch_format = format;
+  std::vector<snapshot> batch;
+  uint64_t bytes = 0;
+  // Start with a different shard each round, so that none is favoured.
+  flush_cursor++;
+  for (int i = 0; i < SWAP_SPACE_SHARDS && dirty_objects > low &&
+	 bytes < WRITE_BATCH_MAX_BYTES; i++) {
+    shard &sh = shards[(flush_cursor + i) % SWAP_SPACE_SHARDS];
+    std::lock_guard<std::mutex> guard(sh.lock);
+    auto it = sh.dirty_list.begin();
+    while (it != sh.dirty_list.end() && dirty_objects > low &&
+	   bytes < WRITE_BATCH_MAX_BYTES) {
+      object *obj = *it++;
+      if (obj->pincount > 0)
+	continue;
+      batch.push_back(snapshot());
+      snapshot &snap = batch.back();
+      snap.obj = obj;
+      snap.version = obj->version + 1;
+      take_buffer(snap.buffer);
+      take_buffer(snap.encoded);
+      snap.summary = serialize_object(obj, snap.buffer, batch_format, false);
+      bytes += snap.buffer.size();
+      // Writes made while we are busy dirty it again.
+      obj->target_is_dirty = false;
+      dirty_list_remove(obj);
+      if (obj->pincount++ == 0)
+	sh.policy->on_pin(obj);
+    }
+  }
+  if (batch.empty())
+    return false;
+
+  std::vector<backing_store::batch_write> writes;
+  writes.reserve(batch.size());
+  for (auto sit = batch.begin(); sit != batch.end(); ++sit) {
+    encode_node(sit->buffer.data(), sit->buffer.size(), batch_codec,
+		batch_format, sit->summary, sit->encoded);
+    backing_store::batch_write w = { sit->obj->id, sit->version,
+				     sit->encoded.data(), sit->encoded.size() };
+    writes.push_back(w);
+  }
+  backstore->write_batch(writes);
+
+  for (size_t i = 0; i < batch.size(); i++) {
+    object *obj = batch[i].obj;
+    shard &sh = shard_of(obj->id);
+    std::lock_guard<std::mutex> guard(sh.lock);
+    obj->version = batch[i].version;
+    give_buffer(batch[i].buffer);
+    give_buffer(batch[i].encoded);
+    assert(obj->pincount > 0);
+    if (--obj->pincount > 0)
+      continue;
+    // It may have been freed meanwhile; then its id can be reused
+    // now.
+    if (obj->live)
+      unpinned(obj);
+    else
+      sh.free_ids.push_back(obj->id);
+  }
+  return true;
+}
+
+void swap_space::start_prefetchers(unsigned n)
+{
+  std::lock_guard<std::mutex> guard(prefetch_lock);
+  assert(prefetchers.empty());
+  prefetchers_stopping = false;
+  for (unsigned i = 0; i < n; i++)
+    prefetchers.push_back(std::thread(&swap_space::prefetcher_main, this));
+}
+
+void swap_space::stop_prefetchers(void)
+{
+  {
+    std::lock_guard<std::mutex> guard(prefetch_lock);
+    prefetchers_stopping = true;
+    prefetch_wakeup.notify_all();
+  }
+  for (auto it = prefetchers.begin(); it != prefetchers.end(); ++it)
+    it->join();
+  prefetchers.clear();
+  prefetches.clear();
+  prefetch_queue.clear();
+  prefetch_ready.clear();
+}
+
+//queue a background read of an object that is only on the backing store.
+void swap_space::prefetch(swap_space::object *obj)
+{
+  if (obj->loaded)
+    return;
+  std::lock_guard<std::mutex> guard(shard_of(obj->id).lock);
+  uint64_t id = obj->id;
+  if (obj->target != NULL || obj->loading || obj->in_tier || obj->version == 0)
+    return;
+  std::lock_guard<std::mutex> pguard(prefetch_lock);
+  if (prefetchers.empty() ||
+      prefetches.size() - prefetch_ready.size() >= PREFETCH_MAX_OUTSTANDING ||
+      prefetches.count(id) > 0)
+    return;
+  prefetch_entry &e = prefetches[id];
+  e.state = PREFETCH_QUEUED;
+  e.version = obj->version;
+  prefetch_queue.push_back(id);
+  prefetch_wakeup.notify_one();
+}
+
+//hand a load the decoded bytes of obj's current version, if they were
+//prefetched.  Waits if they are being read right now.
+bool swap_space::take_prefetched(swap_space::object *obj, std::string &raw,
+				 uint8_t &raw_format)
+{
+  std::unique_lock<std::mutex> pguard(prefetch_lock);
+  auto it = prefetches.find(obj->id);
+  if (it == prefetches.end())
+    return false;
+  while (it->second.state == PREFETCH_READING) {
+    prefetch_done.wait(pguard);
+    it = prefetches.find(obj->id);
+    if (it == prefetches.end())
+      return false;
+  }
+  bool hit = it->second.state == PREFETCH_READY &&
+    it->second.version == obj->version;
+  if (hit) {
+    raw.swap(it->second.raw);
+    raw_format = it->second.format;
+  }
+  // A queued entry is dropped; the prefetcher skips it.
+  prefetch_erase(it);
+  return hit;
+}
+
+void swap_space::prefetch_forget(swap_space::object *obj)
+{
+  std::unique_lock<std::mutex> pguard(prefetch_lock);
+  auto it = prefetches.find(obj->id);
+  while (it != prefetches.end() && it->second.state == PREFETCH_READING) {
+    prefetch_done.wait(pguard);
+    it = prefetches.find(obj->id);
+  }
+  if (it != prefetches.end())
+    prefetch_erase(it);
+}
+
+//drop a prefetch entry that is not being read.  prefetch_lock is held.
+void swap_space::prefetch_erase(prefetch_iterator it)
+{
+  if (it->second.state == PREFETCH_READY)
+    prefetch_ready.erase(it->second.ready_pos);
+  prefetches.erase(it);
+}
+
+void swap_space::prefetcher_main(void)
+{
+  std::unique_lock<std::mutex> pguard(prefetch_lock);
+  while (!prefetchers_stopping) {
+    if (prefetch_queue.empty()) {
+      prefetch_wakeup.wait(pguard);
+      continue;
+    }
+    uint64_t id = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    auto it = prefetches.find(id);
+    if (it == prefetches.end() || it->second.state != PREFETCH_QUEUED)
+      continue;
+    it->second.state = PREFETCH_READING;
+    uint64_t version = it->second.version;
+    pguard.unlock();
+
+    std::string stored, raw;
+    uint8_t raw_format;
+    backstore->read(id, version, stored);
+    if (!decode_node(stored, raw, raw_format, headerless_nodes))
+      corrupt_version(id, version, "backing store");
+
+    pguard.lock();
+    // Nobody erases an entry while it is being read.
+    it = prefetches.find(id);
+    assert(it != prefetches.end() && it->second.state == PREFETCH_READING);
+    it->second.raw.swap(raw);
+    it->second.format = raw_format;
+    it->second.state = PREFETCH_READY;
+    it->second.ready_pos = prefetch_ready.insert(prefetch_ready.end(), id);
+    if (prefetch_ready.size() > PREFETCH_MAX_READY)
+      prefetch_erase(prefetches.find(prefetch_ready.front()));
+    prefetch_done.notify_all();
+  }
+}
@@ -44,11 +44,59 @@
 // dereference "this" and any other plain C++ pointers in the object.
 
 // Objects are automatically garbage collected.  The garbage collector
-// uses reference counting.
-
-// The current system uses LRU to select items to swap.  The swap
-// space has a user-specified in-memory cache size it.  The cache size
-// can be adjusted dynamically.
+// uses reference counting.  Object bookkeeping lives in a table of
+// fixed-size chunks indexed by id, and the ids of collected objects
+// are handed out again.  A reused id carries on from the last version
+// of its previous owner, so no stored version is ever overwritten.
+
+// An eviction_policy (see eviction_policy.hpp) selects items to
+// swap, LRU unless another is given at construction.  The swap space
+// has a user-specified in-memory cache size it, in objects, and
+// optionally a byte budget checked against each object's
+// memory_footprint().  The cache size can be adjusted dynamically.
+// A share of the cache can be reserved for internal objects (those
+// that are not is_leaf()), e.g. the upper levels of a tree, which
+// are then only evicted to make room when they exceed it.
+// Policy bookkeeping is intrusive (linked through the objects
+// themselves).  The default LRU list only holds objects that are in
+// memory and unpinned, so touching an object and picking a victim are
+// both constant-time.
+
+// Optionally, evicted objects first go to a compressed tier: their
+// serialized, compressed form is kept in a bounded pool of RAM, and
+// loading them from there costs a decompression instead of a read.
+// Only what overflows the pool is written to the backing store.
+
+// A background flusher thread can be started to write dirty objects
+// back while they are still in memory, so that eviction usually finds
+// clean victims that can be dropped without I/O.  The flusher only
+// snapshots unpinned objects, and keeps them pinned until their write
+// is done.
+
+// Pointers and pins may be used from several threads.  Objects are
+// spread by id over SWAP_SPACE_SHARDS shards, each with its own lock,
+// part of the object table, eviction policy, dirty list, compressed
+// tier and write batch.  Reference and pin counts are atomic, so
+// copying or dropping a pointer, and pinning an object that is
+// already pinned, take no lock; the first pin and the last unpin take
+// the object's shard lock.  Accessing a pinned object that is in
+// memory takes no lock either: the access is recorded in the object
+// and passed on to the policy when the last pin goes, which is the
+// first time the policy could choose the object anyway.  A load reads,
+// decodes and deserializes its object with the shard lock released;
+// the object is marked as loading meanwhile, and other threads that
+// want it wait for that load rather than starting their own.  The
+// cache budgets are global, and victims come from the shard with the
+// most resident objects.  Caches too small to give every shard's policy
+// SWAP_SPACE_SHARD_MIN_OBJECTS use fewer shards; a small enough one
+// uses just one, with one policy over the whole cache.  (The betree
+// itself is not thread-safe.)
+
+// pointer::prefetch() hints that an object will be needed soon.  If
+// prefetch threads have been started and the object is only on the
+// backing store, one of them reads and decodes it in the background;
+// the load that follows then only has to deserialize it.  A bounded
+// number of decoded objects wait for their loads, oldest dropped first.
 
 // Don't try to get your hands on an unwrapped pointer to the object
 // or anything that is swapped in/out as part of the object.  It can
@@ -63,43 +111,317 @@
 // a few basic types and STL containers.  Feel free to add more and
 // submit patches as you need them.
 
-// The current implementation serializes to a textual file format.
-// This is just a convenience.  It would be nice to be able to swap in
-// different formats.
+// Objects are serialized either to a textual format, which is a
+// convenience for debugging, or to a compact binary one: fixed-width
+// little-endian integers, and length-prefixed strings and containers.
+// The format is chosen per swap_space with set_serialization_format()
+// and recorded with each stored version, like the codec.  All the
+// serialize()/deserialize() overloads below handle both; _serialize()
+// methods that write punctuation of their own should only do so for
+// SERIAL_TEXT.  A third format, SERIAL_COMPACT, is SERIAL_BINARY as far
+// as these overloads are concerned, but tells objects that keep sorted
+// runs of values to delta-encode them (see serialize_delta()).
+// context.binary() is true for both.
+
+// Types whose binary encoding is exactly their bytes in memory can say
+// so by specializing serial_raw (see below).  Single values of them are
+// then copied with one write, and maps and vectors of them in bulk,
+// without going through _serialize() for each element.
+
+// Serialized objects pass through a compression codec (see
+// compression.hpp) on their way to and from the backing store.  The
+// codec is chosen per swap_space with set_compression() and recorded
+// with each stored version, so changing it never strands old data.
 
 #ifndef SWAP_SPACE_HPP
 #define SWAP_SPACE_HPP
 
 #include <cstdint>
+#include <algorithm>
+#include <atomic>
 #include <unordered_map>
 #include <map>
-#include <set>
+#include <list>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include <functional>
+#include <type_traits>
 #include <vector>
 #include <sstream>
 #include <cassert>
+#include <cstring>
 #include "backing_store.hpp"
+#include "compression.hpp"
+#include "eviction_policy.hpp"
+#include "flat_map.hpp"
 #include "debug.hpp"
 
 class swap_space;
 
+// Serialization formats.
+#define SERIAL_TEXT    (0)
+#define SERIAL_BINARY  (1)
+#define SERIAL_COMPACT (2)
+
+// Maps "text", "binary" and "compact" to a format.  Returns false if the name is
+// unknown.
+bool parse_serialization_format_name(const std::string &name, uint8_t &format);
+
 class serialization_context {
 public:
-  serialization_context(swap_space &sspace) :
+  serialization_context(swap_space &sspace, uint8_t format,
+			bool evicting = true) :
     ss(sspace),
-    is_leaf(true)
-  {}
+    format(format),
+    is_leaf(true),
+    evicting(evicting),
+    buffer(NULL),
+    id(0),
+    version(0),
+    detached(false)
+  {
+    summary.kind = NODE_KIND_UNKNOWN;
+    summary.pivots = 0;
+    summary.elements = 0;
+  }
+  bool binary(void) const { return format != SERIAL_TEXT; }
+
   swap_space &ss;
+  uint8_t format;
   bool is_leaf;
+  // False when the object stays in memory after being serialized, so
+  // its pointers must be left intact.
+  bool evicting;
+  // When loading an object: all the bytes being deserialized, which
+  // the stream reads in place.  The object may take them over (by
+  // swapping) once it has read everything, to decode parts of them
+  // later.
+  std::string *buffer;
+  // The object being stored or loaded, and the version of it the bytes
+  // are: when storing, the version they will be written as if they
+  // are written at all; when loading, the stored version they were
+  // read from, or 0 if they are not on the backing store as they are.
+  // Objects that store themselves as deltas against an older version
+  // (see swap_space::read_version()) need these.
+  uint64_t id;
+  uint64_t version;
+  // Set when an old version is read only for the rest of its
+  // contents.  Pointers then read their target and nothing else, and
+  // stay null, since the references they stood for are long gone.
+  bool detached;
+  // Filled in by the object being stored, for the node header.
+  node_summary summary;
+};
+
+// A write-only stream buffer that serializes straight into a string
+// the caller owns, after what is already there.  The string's spare
+// capacity is the put area, so nothing is copied out afterwards and a
+// string that is reused keeps its capacity.  The string only has its
+// final size once the buffer is gone.
+class string_buffer : public std::streambuf {
+public:
+  string_buffer(std::string &s) : s(s), end(s.size()) {
+    s.resize(s.capacity() > end ? s.capacity() : end);
+    reset(end);
+  }
+
+  ~string_buffer(void) {
+    note_end();
+    s.resize(end);
+  }
+
+protected:
+  int_type overflow(int_type c) {
+    if (c == traits_type::eof())
+      return traits_type::not_eof(c);
+    grow(1);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+  }
+
+  std::streamsize xsputn(const char *p, std::streamsize n) {
+    if (n <= 0)
+      return 0;
+    if (epptr() - pptr() < n)
+      grow(n);
+    memcpy(pptr(), p, n);
+    pbump(n);
+    return n;
+  }
+
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+		   std::ios_base::openmode which = std::ios_base::out) {
+    note_end();
+    off_type base = dir == std::ios_base::beg ? 0 :
+      dir == std::ios_base::cur ? (off_type)(pptr() - pbase()) : (off_type)end;
+    if (!(which & std::ios_base::out) ||
+	base + off < 0 || base + off > (off_type)end)
+      return pos_type(off_type(-1));
+    reset(base + off);
+    return pos_type(base + off);
+  }
+
+  pos_type seekpos(pos_type p,
+		   std::ios_base::openmode which = std::ios_base::out) {
+    return seekoff(off_type(p), std::ios_base::beg, which);
+  }
+
+private:
+  // A seekp() back leaves the end where it was.
+  void note_end(void) {
+    if ((size_t)(pptr() - pbase()) > end)
+      end = pptr() - pbase();
+  }
+
+  void reset(size_t pos) {
+    char *base = s.empty() ? NULL : &s[0];
+    setp(base, base + s.size());
+    pbump(pos);
+  }
+
+  void grow(size_t n) {
+    size_t pos = pptr() - pbase();
+    note_end();
+    size_t size = 2 * s.size() > 256 ? 2 * s.size() : 256;
+    if (size < pos + n)
+      size = pos + n;
+    s.resize(size);
+    reset(pos);
+  }
+
+  std::string &s;
+  size_t end;
+};
+
+// A read-only stream buffer over bytes that stay where they are, so
+// that deserializing them does not copy them first.
+class memory_buffer : public std::streambuf {
+public:
+  memory_buffer(const char *begin, size_t len) {
+    char *b = const_cast<char *>(begin);
+    setg(b, b, b + len);
+  }
+
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+		   std::ios_base::openmode which = std::ios_base::in) {
+    char *base = dir == std::ios_base::beg ? eback() :
+      dir == std::ios_base::cur ? gptr() : egptr();
+    if (!(which & std::ios_base::in) ||
+	off < eback() - base || off > egptr() - base)
+      return pos_type(off_type(-1));
+    setg(eback(), base + off, egptr());
+    return pos_type(gptr() - eback());
+  }
+
+  pos_type seekpos(pos_type pos,
+		   std::ios_base::openmode which = std::ios_base::in) {
+    return seekoff(off_type(pos), std::ios_base::beg, which);
+  }
 };
 
 class serializable {
 public:
   virtual void _serialize(std::iostream &fs, serialization_context &context) = 0;
   virtual void _deserialize(std::iostream &fs, serialization_context &context) = 0;
+  // Approximate number of bytes of memory this object occupies, for
+  // cache accounting.  Must be cheap: it is asked again every time the
+  // object is unpinned.  Objects that don't say are only counted.
+  virtual uint64_t memory_footprint(void) const { return 0; }
+  // Whether this object points to no other swappable objects, asked
+  // along with memory_footprint().  The others count as internal, see
+  // swap_space::set_internal_share().
+  virtual bool is_leaf(void) const { return false; }
+  // Called before every access that may modify the object.  Objects
+  // that keep part of themselves in serialized form until then (see
+  // serialization_context::buffer) should unpack it here.
+  virtual void materialize(void) {}
   virtual ~serializable(void) {};
 };
 
+// Approximate in-memory size of a value, including what it owns on the
+// heap.  Types that own nothing are just their size.
+template<class X> uint64_t footprint(const X &x)
+{
+  return sizeof(X);
+}
+
+inline uint64_t footprint(const std::string &x)
+{
+  // Short strings live inside the object itself.
+  return sizeof(x) + (x.capacity() > 15 ? x.capacity() + 1 : 0);
+}
+
+// Red-black tree node links and color, on top of the key and value.
+#define STD_MAP_NODE_OVERHEAD (32)
+
+template<class X> uint64_t footprint(const std::vector<X> &v)
+{
+  uint64_t total = sizeof(v) + (v.capacity() - v.size()) * sizeof(X);
+  for (auto it = v.begin(); it != v.end(); ++it)
+    total += footprint(*it);
+  return total;
+}
+
+template<class Key, class Value> uint64_t footprint(const std::map<Key, Value> &mp)
+{
+  uint64_t total = sizeof(mp);
+  for (auto it = mp.begin(); it != mp.end(); ++it)
+    total += STD_MAP_NODE_OVERHEAD + footprint(it->first) + footprint(it->second);
+  return total;
+}
+
+template<class Key, class Value> uint64_t footprint(const flat_map<Key, Value> &mp)
+{
+  uint64_t total = mp.overhead_bytes();
+  for (auto it = mp.begin(); it != mp.end(); ++it)
+    total += footprint(it->first) + footprint(it->second);
+  return total;
+}
+
+// Fixed-width little-endian integers, as used by SERIAL_BINARY.
+void write_le(std::iostream &fs, uint64_t x, int width);
+uint64_t read_le(std::iostream &fs, int width);
+uint64_t load_le(const char *p, int width);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SERIAL_HOST_LE (1)
+#else
+#define SERIAL_HOST_LE (0)
+#endif
+
+// Whether SERIAL_BINARY encodes X as just its sizeof(X) bytes in
+// memory.  Only ever true for trivially copyable types, and only on
+// little-endian hosts for anything containing integers.
+template<class X> struct serial_raw : std::false_type {};
+template<class X> struct serial_raw<const X> : serial_raw<X> {};
+#if SERIAL_HOST_LE
+template<> struct serial_raw<uint32_t> : std::true_type {};
+template<> struct serial_raw<uint64_t> : std::true_type {};
+template<> struct serial_raw<int64_t> : std::true_type {};
+#endif
+
+// n values of a serial_raw type, straight to and from the stream.
+template<class X> void write_raw(std::iostream &fs, const X *p, uint64_t n)
+{
+  static_assert(std::is_trivially_copyable<X>::value, "not trivially copyable");
+  fs.write((const char *)p, n * sizeof(X));
+  assert(fs.good());
+}
+
+template<class X> void read_raw(std::iostream &fs, X *p, uint64_t n)
+{
+  static_assert(std::is_trivially_copyable<X>::value, "not trivially copyable");
+  fs.read((char *)p, n * sizeof(X));
+  assert(fs.good());
+}
+
+void serialize(std::iostream &fs, serialization_context &context, uint32_t x);
+void deserialize(std::iostream &fs, serialization_context &context, uint32_t &x);
+
 void serialize(std::iostream &fs, serialization_context &context, uint64_t x);
 void deserialize(std::iostream &fs, serialization_context &context, uint64_t &x);
 
@@ -109,10 +431,122 @@ void deserialize(std::iostream &fs, serialization_context &context, int64_t &x);
 void serialize(std::iostream &fs, serialization_context &context, std::string x);
 void deserialize(std::iostream &fs, serialization_context &context, std::string &x);
 
-template<class Key, class Value> void serialize(std::iostream &fs,
-						serialization_context &context,
-						std::map<Key, Value> &mp)
+// LEB128 variable-length integers: 7 bits a byte, low bits first.
+void write_varint(std::iostream &fs, uint64_t x);
+uint64_t read_varint(std::iostream &fs);
+
+// Delta encodings for sorted runs of values, each written relative to
+// the one before it (binary formats only).  Integers are the zigzagged
+// difference as a varint, so small steps either way take a byte or
+// two, and strings are the length of the prefix they share with the
+// previous one and the rest.  deserialize_delta() expects x to hold
+// the previous value.  Starting from a default-constructed value gives
+// the full one.  Other types are written in full.
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     uint64_t prev, uint64_t x);
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       uint64_t &x);
+
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     int64_t prev, int64_t x);
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       int64_t &x);
+
+void serialize_delta(std::iostream &fs, serialization_context &context,
+		     const std::string &prev, const std::string &x);
+void deserialize_delta(std::iostream &fs, serialization_context &context,
+		       std::string &x);
+
+template<class X> void serialize_delta(std::iostream &fs,
+				       serialization_context &context,
+				       const X &prev, const X &x)
+{
+  serialize(fs, context, x);
+}
+
+template<class X> void deserialize_delta(std::iostream &fs,
+					 serialization_context &context,
+					 X &x)
+{
+  deserialize(fs, context, x);
+}
+
+// The entries of a binary map, one by one, or gathered into a single
+// block when both halves are raw.  Map is a std::map or a flat_map.
+template<class Map> void serialize_entries(std::iostream &fs,
+					    serialization_context &context,
+					    Map &mp, std::false_type)
+{
+  for (auto it = mp.begin(); it != mp.end(); ++it) {
+    serialize(fs, context, it->first);
+    serialize(fs, context, it->second);
+  }
+}
+
+template<class Map> void serialize_entries(std::iostream &fs,
+					    serialization_context &context,
+					    Map &mp, std::true_type)
+{
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  std::vector<char> block(mp.size() * (sizeof(Key) + sizeof(Value)));
+  char *p = block.data();
+  for (auto it = mp.begin(); it != mp.end(); ++it) {
+    memcpy(p, &it->first, sizeof(Key));
+    memcpy(p + sizeof(Key), &it->second, sizeof(Value));
+    p += sizeof(Key) + sizeof(Value);
+  }
+  write_raw(fs, block.data(), block.size());
+}
+
+template<class Map> void deserialize_entries(std::iostream &fs,
+					      serialization_context &context,
+					      Map &mp, uint64_t size,
+					      std::false_type)
+{
+  // Entries come in order, so each goes in at the end.
+  for (uint64_t i = 0; i < size; i++) {
+    typename Map::key_type k;
+    typename Map::mapped_type v;
+    deserialize(fs, context, k);
+    deserialize(fs, context, v);
+    mp.emplace_hint(mp.end(), k, v);
+  }
+}
+
+template<class Map> void deserialize_entries(std::iostream &fs,
+					      serialization_context &context,
+					      Map &mp, uint64_t size,
+					      std::true_type)
+{
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  std::vector<char> block(size * (sizeof(Key) + sizeof(Value)));
+  read_raw(fs, block.data(), block.size());
+  const char *p = block.data();
+  for (uint64_t i = 0; i < size; i++) {
+    Key k;
+    Value v;
+    memcpy(&k, p, sizeof(Key));
+    memcpy(&v, p + sizeof(Key), sizeof(Value));
+    mp.emplace_hint(mp.end(), k, v);
+    p += sizeof(Key) + sizeof(Value);
+  }
+}
+
+template<class Map> void serialize_map(std::iostream &fs,
+					serialization_context &context,
+					Map &mp)
 {
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  if (context.binary()) {
+    serialize(fs, context, (uint64_t)mp.size());
+    serialize_entries(fs, context, mp,
+		      std::integral_constant<bool, serial_raw<Key>::value &&
+					     serial_raw<Value>::value>());
+    return;
+  }
   
   fs << "map " << mp.size() << " {" << std::endl;
   assert(fs.good());
@@ -130,10 +564,21 @@ template<class Key, class Value> void serialize(std::iostream &fs,
   
 }
 
-template<class Key, class Value> void deserialize(std::iostream &fs,
-						  serialization_context &context,
-						  std::map<Key, Value> &mp)
+template<class Map> void deserialize_map(std::iostream &fs,
+					  serialization_context &context,
+					  Map &mp)
 {
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  if (context.binary()) {
+    uint64_t size;
+    deserialize(fs, context, size);
+    deserialize_entries(fs, context, mp, size,
+			std::integral_constant<bool, serial_raw<Key>::value &&
+					       serial_raw<Value>::value>());
+    return;
+  }
+
   std::string dummy;
   int size = 0;
   fs >> dummy >> size >> dummy;
@@ -149,34 +594,213 @@ template<class Key, class Value> void deserialize(std::iostream &fs,
   fs >> dummy;
 }
 
+template<class Key, class Value> void serialize(std::iostream &fs,
+						serialization_context &context,
+						std::map<Key, Value> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template<class Key, class Value> void deserialize(std::iostream &fs,
+						  serialization_context &context,
+						  std::map<Key, Value> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
+// The same as a std::map with the same entries.
+template<class Key, class Value> void serialize(std::iostream &fs,
+						serialization_context &context,
+						flat_map<Key, Value> &mp)
+{
+  serialize_map(fs, context, mp);
+}
+
+template<class Key, class Value> void deserialize(std::iostream &fs,
+						  serialization_context &context,
+						  flat_map<Key, Value> &mp)
+{
+  deserialize_map(fs, context, mp);
+}
+
+// Arrays, as used by vectors: one block when raw.
+template<class X> void serialize_array(std::iostream &fs,
+				       serialization_context &context,
+				       X *p, uint64_t n, std::false_type)
+{
+  for (uint64_t i = 0; i < n; i++)
+    serialize(fs, context, p[i]);
+}
+
+template<class X> void serialize_array(std::iostream &fs,
+				       serialization_context &context,
+				       X *p, uint64_t n, std::true_type)
+{
+  if (context.binary())
+    write_raw(fs, p, n);
+  else
+    serialize_array(fs, context, p, n, std::false_type());
+}
+
+template<class X> void deserialize_array(std::iostream &fs,
+					 serialization_context &context,
+					 X *p, uint64_t n, std::false_type)
+{
+  for (uint64_t i = 0; i < n; i++)
+    deserialize(fs, context, p[i]);
+}
+
+template<class X> void deserialize_array(std::iostream &fs,
+					 serialization_context &context,
+					 X *p, uint64_t n, std::true_type)
+{
+  if (context.binary())
+    read_raw(fs, p, n);
+  else
+    deserialize_array(fs, context, p, n, std::false_type());
+}
+
+template<class X> void serialize_array(std::iostream &fs,
+				       serialization_context &context,
+				       X *p, uint64_t n)
+{
+  serialize_array(fs, context, p, n, serial_raw<X>());
+}
+
+template<class X> void deserialize_array(std::iostream &fs,
+					 serialization_context &context,
+					 X *p, uint64_t n)
+{
+  deserialize_array(fs, context, p, n, serial_raw<X>());
+}
+
+template<class X> void serialize(std::iostream &fs,
+				 serialization_context &context,
+				 std::vector<X> &v)
+{
+  if (context.binary()) {
+    serialize(fs, context, (uint64_t)v.size());
+    serialize_array(fs, context, v.data(), v.size());
+    return;
+  }
+  fs << "vector " << v.size() << " [ ";
+  serialize_array(fs, context, v.data(), v.size());
+  fs << " ]" << std::endl;
+  assert(fs.good());
+}
+
+template<class X> void deserialize(std::iostream &fs,
+				   serialization_context &context,
+				   std::vector<X> &v)
+{
+  uint64_t size;
+  std::string dummy;
+  if (context.binary())
+    deserialize(fs, context, size);
+  else
+    fs >> dummy >> size >> dummy;
+  assert(fs.good());
+  v.resize(size);
+  deserialize_array(fs, context, v.data(), v.size());
+  if (!context.binary())
+    fs >> dummy;
+}
+
 template<class X> void serialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  fs << "pointer ";
+  if (!context.binary())
+    fs << "pointer ";
   serialize(fs, context, *x);
 }
 
 template<class X> void deserialize(std::iostream &fs, serialization_context &context, X *&x)
 {
-  std::string dummy;
   x = new X;
-  fs >> dummy;
-  assert (dummy == "pointer");
+  if (!context.binary()) {
+    std::string dummy;
+    fs >> dummy;
+    assert (dummy == "pointer");
+  }
   deserialize(fs, context, *x);
 }
 
-template<class X> void serialize(std::iostream &fs, serialization_context &context, X &x)
+template<class X> void serialize(std::iostream &fs, serialization_context &context,
+				 X &x, std::false_type)
 {
   x._serialize(fs, context);
 }
 
-template<class X> void deserialize(std::iostream &fs, serialization_context &context, X &x)
+template<class X> void serialize(std::iostream &fs, serialization_context &context,
+				 X &x, std::true_type)
+{
+  if (context.binary())
+    write_raw(fs, &x, 1);
+  else
+    x._serialize(fs, context);
+}
+
+template<class X> void deserialize(std::iostream &fs, serialization_context &context,
+				   X &x, std::false_type)
 {
   x._deserialize(fs, context);
 }
 
+template<class X> void deserialize(std::iostream &fs, serialization_context &context,
+				   X &x, std::true_type)
+{
+  if (context.binary())
+    read_raw(fs, &x, 1);
+  else
+    x._deserialize(fs, context);
+}
+
+template<class X> void serialize(std::iostream &fs, serialization_context &context, X &x)
+{
+  serialize(fs, context, x, serial_raw<X>());
+}
+
+template<class X> void deserialize(std::iostream &fs, serialization_context &context, X &x)
+{
+  deserialize(fs, context, x, serial_raw<X>());
+}
+
+// Evictions and checkpoints queue up dirty objects and write them to
+// the backing store in batches of roughly this many bytes.
+#define WRITE_BATCH_MAX_BYTES (8ULL << 20)
+
+// Objects are spread over this many shards by id (see swap_space::shard).
+#define SWAP_SPACE_SHARDS (16)
+
+// Each shard's eviction policy gets at least this much of the cache.
+// 2Q and ARC size their queues and ghost lists from their capacity, and
+// are no better than FIFO with a tiny one, so smaller caches put new
+// objects in fewer shards.
+#define SWAP_SPACE_SHARD_MIN_OBJECTS (64)
+
+// Each shard allocates objects this many at a time, in id order.
+#define OBJECT_TABLE_CHUNK (256)
+
+// Spare byte buffers kept for serializing and writing back objects.
+#define BUFFER_POOL_MAX (64)
+
+// Prefetch hints beyond this many outstanding reads (queued or being
+// read) are dropped.
+#define PREFETCH_MAX_OUTSTANDING (64)
+
+// Prefetched nodes kept decoded for a load that has not come yet.  Past
+// this many the oldest is dropped, so prefetches that are never used
+// (a scan that stops early, say) do not pile up outside the cache.
+#define PREFETCH_MAX_READY (64)
+
 class swap_space {
+private:
+  class object;
+  struct shard;
+
 public:
-  swap_space(backing_store *bs, uint64_t n);
+  // The swap_space takes ownership of policy.  NULL means LRU.
+  swap_space(backing_store *bs, uint64_t n, eviction_policy *policy = NULL);
+  ~swap_space(void);
 
   template<class Referent> class pointer;
 
@@ -195,12 +819,14 @@ public:
   }
 
   uint64_t getTargetVersion(uint64_t targetId) {
+    std::lock_guard<std::mutex> guard(shard_of(targetId).lock);
     debug(std::cout << "targetId:" << targetId << std::endl);
-    if (objects.find(targetId) == objects.end()) {
+    object *obj = lookup(targetId);
+    if (obj == NULL) {
       debug(std::cout << "targitId:" << targetId << " not found" << std::endl);
       return 1;
     } else {
-      return objects[targetId]->version;
+      return obj->version;
     }
   }
 
@@ -210,8 +836,58 @@ public:
 
   std::string getRootDir(void);
 
+  // Read and decode an older stored version of an object, for objects
+  // that store later versions as deltas against it.  Takes no lock.
+  void read_version(uint64_t id, uint64_t version, std::string &raw,
+		    uint8_t &raw_format);
+
   void setObjectsForRecovery(std::unordered_map<uint64_t, uint64_t> &objsMap);
 
+  // Codec used for objects written from now on (CODEC_NONE, CODEC_LZ,
+  // CODEC_ZLIB).
+  void set_compression(uint8_t codec);
+
+  // Serialization format for objects written from now on (SERIAL_TEXT,
+  // SERIAL_BINARY, SERIAL_COMPACT).
+  void set_serialization_format(uint8_t format);
+
+  // Read stored versions without a node header as text nodes from
+  // before headers existed, instead of failing on them as damaged.
+  // Off by default, since an empty or torn file has no header either.
+  void set_headerless_nodes(bool allow);
+
+  // Have the eviction policy pick clean victims over dirty ones when
+  // it can, to save write-backs.
+  void set_prefer_clean_victims(bool prefer);
+
+  // Reserve share (a fraction) of the cache, in objects and in bytes,
+  // for internal objects: while they fit in it, only leaves are
+  // evicted, unless nothing else can be.  0 (the default) reserves
+  // nothing.
+  void set_internal_share(double share);
+
+  // Also evict whenever the resident objects' memory_footprint()s add
+  // up to more than sz bytes.  0 (the default) means no byte limit.
+  void set_cache_bytes(uint64_t sz);
+  uint64_t get_cache_bytes(void) const { return current_in_memory_bytes; }
+
+  // Size of the compressed tier, in bytes of compressed data.  0 (the
+  // default) disables it.
+  void set_compressed_cache_bytes(uint64_t sz);
+  uint64_t get_compressed_cache_bytes(void) const { return tier_bytes; }
+
+  // Start a thread that writes back dirty objects whenever more than
+  // dirty_watermark (a fraction) of the objects in memory are dirty,
+  // until at most half that many are.  It also checks every
+  // interval_ms.
+  void start_flusher(double dirty_watermark, unsigned interval_ms = 100);
+  void stop_flusher(void);
+
+  // Start n threads that serve pointer::prefetch() hints.  Without
+  // them, hints are ignored.
+  void start_prefetchers(unsigned n);
+  void stop_prefetchers(void);
+
   // This pins an object in memory for the duration of a member
   // access.  It's sort of an instance of the "resource aquisition is
   // initialization" paradigm.
@@ -219,34 +895,31 @@ public:
   class pin {
   public:
     const Referent * operator->(void) const {
-      assert(ss->objects.count(target) > 0);
-      debug(std::cout << "Accessing (constly) " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
-      access(target, false);
-      return (const Referent *)ss->objects[target]->target;
+      debug(std::cout << "Accessing (constly) " << obj->id
+	    << " version " << obj->version << " (" << obj->target << ")" << std::endl);
+      access(false);
+      return (const Referent *)obj->target;
     }
 
     Referent * operator->(void) {
-      assert(ss->objects.count(target) > 0);
       /*
-      debug(std::cout << "Accessing " << target
-	      << " id " << ss->objects[target]->id << " version "
-        << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
+      debug(std::cout << "Accessing " << obj->id
+	      << " version " << obj->version << " (" << obj->target << ")" << std::endl);
       */
-      access(target, true);
-      return (Referent *)ss->objects[target]->target;
+      access(true);
+      return (Referent *)obj->target;
     }
 
     pin(const pointer<Referent> *p)
       : ss(NULL),
-	      target(0)
+	      obj(NULL)
     {
-      dopin(p->ss, p->target);
+      dopin(p->ss, p->obj);
     }
 
     pin(void)
       : ss(NULL),
-	target(0)
+	obj(NULL)
     {}
 
     ~pin(void) {
@@ -256,8 +929,9 @@ public:
     pin &operator=(const pin &other) {
       if (&other != this) {
 	unpin();
-	dopin(other.ss, other.target);
+	dopin(other.ss, other.obj);
       }
+      return *this;
     }
     
   private:
@@ -265,52 +939,97 @@ public:
     //called when pointer no longer accessed - remove pincount and maybe evict from cache.
     void unpin(void) {
       /*
-      debug(std::cout << "Unpinning " << target
-	    << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << " (" << ss->objects[target]->target << ")" << std::endl);
+      debug(std::cout << "Unpinning " << obj->id
+	    << " version " << obj->version << " (" << obj->target << ")" << std::endl);
       */
-      if (target > 0) {
-	assert(ss->objects.count(target) > 0);
-	ss->objects[target]->pincount--;
+      if (obj != NULL && !unpin_nested()) {
+	{
+	  std::lock_guard<std::mutex> guard(ss->shard_of(obj->id).lock);
+	  assert(obj->pincount > 0);
+	  if (--obj->pincount == 0)
+	    ss->unpinned(obj);
+	}
 	ss->maybe_evict_something();
       }
       ss = NULL;
-      target = 0;
+      obj = NULL;
+    }
+
+    //drop a pin that is not the last one, without the lock.  Fails if
+    //it is the last one.
+    bool unpin_nested(void) {
+      uint64_t n = obj->pincount;
+      while (n > 1)
+	if (obj->pincount.compare_exchange_weak(n, n - 1))
+	  return true;
+      return false;
+    }
+
+    //pin an object that is already pinned, without the lock.  Fails if
+    //it is not pinned.
+    bool pin_nested(void) {
+      uint64_t n = obj->pincount;
+      while (n > 0)
+	if (obj->pincount.compare_exchange_weak(n, n + 1))
+	  return true;
+      return false;
     }
 
     //Called when creating pin type - assert target exists, then force load in ss.
-    void dopin(swap_space *newss, uint64_t newtarget) {
-      assert(ss == NULL && target == 0);
+    void dopin(swap_space *newss, object *newobj) {
+      assert(ss == NULL && obj == NULL);
       ss = newss;
-      target = newtarget;
-      if (target > 0) {
-	      assert(ss->objects.count(target) > 0);
+      obj = newobj;
+      if (obj != NULL && !pin_nested()) {
+	      shard &sh = ss->shard_of(obj->id);
+	      std::lock_guard<std::mutex> guard(sh.lock);
         /*
-	      debug(std::cout << "Pinning " << target
-	        << " id " << ss->objects[target]->id << " version "
-          << ss->objects[target]->version << " (" 
-          << ss->objects[target]->target << ")" << std::endl);
+	      debug(std::cout << "Pinning " << obj->id << " version "
+          << obj->version << " (" << obj->target << ")" << std::endl);
         */
-	      ss->objects[target]->pincount++;
+	      if (obj->pincount++ == 0)
+	        sh.policy->on_pin(obj);
       }
     }
-    
-    //Called when accessing object, forces load - requires object to be pinned.
-    void access(uint64_t tgt, bool dirty) const {
-      assert(ss->objects.count(tgt) > 0);
-      object *obj = ss->objects[tgt];
-      ss->lru_pqueue.erase(obj);
-      obj->last_access = ss->next_access_time++;
-      ss->lru_pqueue.insert(obj);
-      obj->target_is_dirty |= dirty;
-      ss->load<Referent>(tgt);
+
+    //Called when accessing object, forces load - requires object to be
+    //pinned.  An object that is in memory, and already dirty if this
+    //access may modify it, is used without any lock; the policy hears
+    //of the access when the last pin goes.
+    void access(bool dirty) const {
+      assert(obj->pincount > 0);
+      if (obj->loaded && (!dirty || obj->target_is_dirty)) {
+	if (dirty)
+	  obj->target->materialize();
+	if (!obj->accessed)
+	  obj->accessed = true;
+	return;
+      }
+      {
+	std::unique_lock<std::mutex> guard(ss->shard_of(obj->id).lock);
+	if (obj->resident)
+	  obj->accessed = true;
+	ss->load<Referent>(obj, guard);
+	if (dirty) {
+	  obj->target->materialize();
+	  // Only now: while it was being loaded, it may have been
+	  // written out and marked clean.
+	  obj->target_is_dirty = true;
+	}
+	if (obj->target_is_dirty)
+	  ss->dirty_list_add(obj);
+      }
       ss->maybe_evict_something();
     }
   
     swap_space *ss;
-    uint64_t target;
+    object *obj;
   };
   
   //pointer wrapper that allows for ss control
+  //A pointer holds a reference to its object, so the object (though not
+  //necessarily its target) stays put for as long as the pointer does,
+  //and the pointer caches it instead of looking its id up each time.
   template<class Referent>
   class pointer : public serializable {
     friend class swap_space;
@@ -319,16 +1038,18 @@ public:
   public:
     pointer(void) :
       ss(NULL),
-      target(0)
+      target(0),
+      obj(NULL)
     {}
     
     pointer(const pointer &other) {
       ss = other.ss;
       target = other.target;
-      if (target > 0) {
-	      assert(ss->objects.count(target) > 0);
-	      ss->objects[target]->refcount++;
-      }
+      obj = other.obj;
+      // other holds a reference, so this cannot race with the object
+      // being freed.
+      if (target > 0)
+	      obj->refcount++;
     }
 
     ~pointer(void) {
@@ -339,36 +1060,47 @@ public:
       if (target == 0) {
 	      return;
       }
-      assert(ss->objects.count(target) > 0);
-
-      object *obj = ss->objects[target];
+      assert(obj != NULL && obj->id == target);
       assert(obj->refcount > 0);
       if ((--obj->refcount) == 0) {
-	      debug(std::cout << "Erasing " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
-	      // Load it into memory so we can recursively free stuff
-	      if (obj->target == NULL) {
-	        assert(obj->version > 0);
-	        if (!obj->is_leaf) {
-	          ss->load<Referent>(target);
-	        } else {
-	          //debug(std::cout << "Skipping load of leaf " << target << " id " << ss->objects[target]->id << " version " << ss->objects[target]->version << std::endl);
+	      // Nobody else can get at it any more, so it cannot be
+	      // loading either.
+	      shard &sh = ss->shard_of(target);
+	      serializable *doomed;
+	      {
+	        std::unique_lock<std::mutex> guard(sh.lock);
+	        assert(!obj->loading);
+	        debug(std::cout << "Erasing " << target << " version " << obj->version << std::endl);
+	        // Load it into memory so we can recursively free stuff
+	        if (obj->target == NULL) {
+	          assert(obj->version > 0 || obj->in_tier);
+	          if (!obj->is_leaf) {
+	            ss->load<Referent>(obj, guard);
+	          } else {
+	            //debug(std::cout << "Skipping load of leaf " << target << " version " << obj->version << std::endl);
+	          }
 	        }
+	        sh.policy->on_forget(obj);
+	        ss->dirty_list_remove(obj);
+	        ss->prefetch_forget(obj);
+	        if (obj->in_tier)
+	          ss->tier_remove(obj);
+	        doomed = obj->target;
+	        if (doomed)
+	          ss->drop_resident(obj);
+	        // do not deallocate node file for recovery.
+          /*
+          if (obj->version > 0) {
+	          ss->backstore->deallocate(obj->id, obj->version);
+          }
+          */
+	        ss->free_object(obj);
 	      }
-	      ss->objects.erase(target);
-	      ss->lru_pqueue.erase(obj);
-	      if (obj->target) {
-	        delete obj->target;
-        }
-	      ss->current_in_memory_objects--;
-	      // do not deallocate node file for recovery.
-        /*
-        if (obj->version > 0) {
-	        ss->backstore->deallocate(obj->id, obj->version);
-        }
-        */
-	      delete obj;
+	      // Its pointers may take this shard's lock again.
+	      delete doomed;
       }
       target = 0;
+      obj = NULL;
     }
 
     pointer & operator=(const pointer &other) {
@@ -376,14 +1108,9 @@ public:
 	      depoint();
 	      ss = other.ss;
 	      target = other.target;
-	      if (target > 0) {
-	        assert(ss->objects.count(target) > 0);
-          if (ss->objects[target] != NULL) {
-	          ss->objects[target]->refcount++;
-          } else {
-            debug(std::cout << "ss->objects[target] == NULL" << std::endl);
-          }
-	      }
+	      obj = other.obj;
+	      if (target > 0)
+	        obj->refcount++;
       }
       return *this;
     }
@@ -396,11 +1123,6 @@ public:
       return !operator==(other);
     }
 	  
-    // const Referent * operator->(void) const {
-    //   ss->access(target, false);
-    //   return ss->objects[target].target;
-    // }
-
     const pin<Referent> operator->(void) const {
       return pin<Referent>(this);
     }
@@ -417,21 +1139,29 @@ public:
       return pin<Referent>(this);
     }
     
+    // Ask for the object to be brought in in the background.  This
+    // never blocks on I/O.
+    void prefetch(void) const {
+      if (target > 0)
+	ss->prefetch(obj);
+    }
+
+    // Both are only a snapshot if other threads use the object.
     bool is_in_memory(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target != NULL;
+      return target > 0 && obj->loaded;
     }
 
     bool is_dirty(void) const {
-      assert(ss->objects.count(target) > 0);
-      return target > 0 && ss->objects[target]->target && ss->objects[target]->target_is_dirty;
+      return target > 0 && obj->loaded && obj->target_is_dirty;
     }
 
     void _serialize(std::iostream &fs, serialization_context &context) {
-      assert(target > 0);
-      assert(context.ss.objects.count(target) > 0);
-      fs << target << " ";
-      target = 0;
+      assert(target > 0 && obj->id == target);
+      serialize(fs, context, target);
+      if (context.evicting) {
+	target = 0;
+	obj = NULL;
+      }
       assert(fs.good());
       context.is_leaf = false;
     }
@@ -439,9 +1169,17 @@ public:
     void _deserialize(std::iostream &fs, serialization_context &context) {
       assert(target == 0);
       ss = &context.ss;
-      fs >> target;
-      assert(fs.good());
-      assert(context.ss.objects.count(target) > 0);
+      deserialize(fs, context, target);
+      if (context.detached) {
+	target = 0;
+	return;
+      }
+      {
+	// Loads deserialize without the lock, and the table may grow.
+	std::lock_guard<std::mutex> guard(ss->shard_of(target).lock);
+	obj = context.ss.lookup(target);
+      }
+      assert(obj != NULL);
       // We just created a new reference to this object and
       // invalidated the on-disk reference, so the total refcount
       // stays the same.
@@ -450,30 +1188,34 @@ public:
   private:
     swap_space *ss;
     uint64_t target;
+    object *obj;
 
     // Only callable through swap_space::allocate(...)
     // This creates new pointers and allocates an object in the ss
     pointer(swap_space *sspace, Referent *tgt, u_int64_t &targetId)
     {
       ss = sspace;
-      target = sspace->next_id++;
-      object *o = new object(sspace, tgt);
-      assert(o != NULL);
-      target = o->id;
-      targetId = target;
-      assert(ss->objects.count(target) == 0);
-      ss->objects[target] = o;
-      ss->lru_pqueue.insert(o);
-      ss->current_in_memory_objects++;
+      shard &sh = sspace->next_shard();
+      {
+	std::lock_guard<std::mutex> guard(sh.lock);
+	object *o = sspace->new_object(sh, tgt);
+	target = o->id;
+	targetId = target;
+	obj = o;
+	ss->make_resident(o);
+	ss->dirty_list_add(o);
+      }
       ss->maybe_evict_something();
     }
 
     // pointer constructor for recovery
     pointer(swap_space *sspace, Referent *tgt, u_int64_t targetId, bool isRecover)
     {
+      std::lock_guard<std::mutex> guard(sspace->shard_of(targetId).lock);
       ss = sspace;
       target = targetId;
-      object *o = ss->objects[targetId];
+      obj = ss->lookup(targetId);
+      assert(obj != NULL);
       debug(std::cout << "in pointer recover construct, targertId = " << 
           targetId << std::endl);
       delete tgt;
@@ -483,58 +1225,244 @@ public:
 private:
   backing_store *backstore;
   std::string rootDir;
-  uint64_t next_id = 1;
-  uint64_t next_access_time = 0;
-  
-  class object {
+  std::atomic<uint8_t> codec;
+  std::atomic<uint8_t> format;
+  std::atomic<bool> headerless_nodes;
+
+  class object : public cache_entry {
   public:
     
-    object(swap_space *sspace, serializable * tgt);
+    object(void);
 
+    // The fields every pin and lookup touches come first.
     serializable * target;
     uint64_t id;
     uint64_t version;
+    std::atomic<uint64_t> refcount;
+    // Set once target is in memory, and cleared before it goes.  A
+    // thread holding a pin may use target without the lock while it
+    // is set.
+    std::atomic<bool> loaded;
+    // Accessed through a pin since the policy last heard of it.
+    std::atomic<bool> accessed;
+    // False for a table slot that holds no object.
+    bool live;
+    // Being read in by some thread, with the lock released.
+    bool loading;
     bool is_leaf;
-    uint64_t refcount;
-    uint64_t last_access;
-    bool target_is_dirty;
-    uint64_t pincount;
+    // memory_footprint() of target when last asked, 0 when not resident.
+    uint64_t footprint;
+    // Size it serialized to last time, to size the next buffer.
+    uint64_t serialized_size;
+
+    // Encoded node, while the object sits in the compressed tier.
+    bool in_tier;
+    std::string compressed;
+    std::list<object *>::iterator tier_pos;
+
+    // Resident and dirty objects are on the dirty list, oldest first.
+    bool in_dirty_list;
+    std::list<object *>::iterator dirty_pos;
   };
 
-  static bool cmp_by_last_access(object *a, object *b);
+  // Dirty objects serialized by write_back() and waiting to be written
+  // out together.
+  struct pending_write {
+    object *obj;
+    uint64_t version;
+    std::string buffer;
+  };
 
+  // A shard's lock covers the shard and the objects whose ids map to
+  // it, but not their pin and reference counts or their loaded and
+  // accessed flags, which are atomic.  No thread ever holds two shard
+  // locks.
+  struct shard {
+    shard(void);
+
+    std::mutex lock;
+    //this shard's part of the object table.  Object id lives at
+    //objects[slot / OBJECT_TABLE_CHUNK][slot % OBJECT_TABLE_CHUNK],
+    //where slot is id / SWAP_SPACE_SHARDS.  Chunks are never moved or
+    //freed, so object pointers stay valid.
+    std::vector<object *> objects;
+    //slot of the next id never handed out.
+    uint64_t next_slot;
+    //ids of collected objects, reused most recently freed first.
+    std::vector<uint64_t> free_ids;
+    eviction_policy *policy;
+    // Resident objects, read without the lock to pick a shard to
+    // evict from.
+    std::atomic<uint64_t> resident;
+    std::list<object *> dirty_list;
+    // The compressed tier, oldest first.
+    std::list<object *> tier;
+    uint64_t tier_bytes;
+    // Writes queued here are always flushed before the lock is
+    // released, so no load can see an object's old version.
+    std::vector<pending_write> pending_writes;
+    uint64_t pending_bytes;
+    // Serialized objects on their way to encode_node().
+    std::string serialize_scratch;
+    // Tells threads waiting for an object that its load is done.
+    std::condition_variable load_done;
+  };
+
+  shard & shard_of(uint64_t id) { return shards[id % SWAP_SPACE_SHARDS]; }
+  shard & next_shard(void) { return shards[next_alloc++ % used_shards]; }
+  void size_shards(uint64_t n);
 
   //ss load - if the object is not in memory (target != null)
-  //bring into memory.
+  //bring into memory.  Called with its shard's lock held in guard,
+  //which is released while the object is read and deserialized.
   template<class Referent>
-  void load(uint64_t tgt) {
-    assert(objects.count(tgt) > 0);
-    if (objects[tgt]->target == NULL) {
-      object *obj = objects[tgt];
+  void load(object *obj, std::unique_lock<std::mutex> &guard) {
+    shard &sh = shard_of(obj->id);
+    while (obj->loading)
+      sh.load_done.wait(guard);
+    if (obj->target == NULL) {
       debug(std::cout << "Loading " << obj->id << " version "
         << obj->version << std::endl);
-      std::iostream *in = backstore->get(obj->id, obj->version);
+      obj->loading = true;
+      bool from_tier = obj->in_tier;
+      uint8_t stored_format;
+      // The tier may spill it meanwhile, so work on a copy.
+      std::string stored = from_tier ? obj->compressed : std::string();
+      uint64_t version = obj->version;
+      guard.unlock();
+
+      std::string buffer;
+      if (from_tier) {
+        if (!decode_node(stored, buffer, stored_format))
+          corrupt_version(obj->id, version, "compressed tier");
+      } else if (!take_prefetched(obj, buffer, stored_format)) {
+        backstore->read(obj->id, version, stored);
+        if (!decode_node(stored, buffer, stored_format, headerless_nodes))
+          corrupt_version(obj->id, version, "backing store");
+      }
+      memory_buffer mb(buffer.data(), buffer.size());
+      std::iostream in(&mb);
       Referent *r = new Referent();
-      serialization_context ctxt(*this);
-      deserialize(*in, ctxt, *r);
-      backstore->put(in);
+      serialization_context ctxt(*this, stored_format);
+      ctxt.buffer = &buffer;
+      ctxt.id = obj->id;
+      ctxt.version = from_tier ? 0 : version;
+      deserialize(in, ctxt, *r);
+
+      guard.lock();
+      if (obj->in_tier)
+        tier_remove(obj);
+      obj->loading = false;
+      sh.load_done.notify_all();
       obj->target = r;
-      current_in_memory_objects++;
+      make_resident(obj);
     }
   }
 
   void set_cache_size(uint64_t sz);
-  
+
+  object * lookup(uint64_t id);
+  object * new_object(shard &sh, serializable *tgt, uint64_t id = 0);
+  void free_object(object *obj);
+  void make_resident(object *obj);
+  void drop_resident(object *obj);
+  void unpinned(object *obj);
+
+  node_summary serialize_object(object *obj, std::string &raw,
+				uint8_t fmt, bool evicting = true);
+  void take_buffer(std::string &buf);
+  void give_buffer(std::string &buf);
   void write_back(object *obj);
+  void queue_write(object *obj, std::string &encoded);
+  void tier_insert(object *obj);
+  void tier_remove(object *obj);
+  void tier_spill(shard &sh);
+  void dirty_list_add(object *obj);
+  void dirty_list_remove(object *obj);
+  void flusher_main(void);
+  bool flush_round(uint64_t low);
+  void prefetch(object *obj);
+  bool take_prefetched(object *obj, std::string &raw, uint8_t &raw_format);
+  void prefetch_forget(object *obj);
+  void prefetcher_main(void);
+  void flush_pending_writes(shard &sh);
+  static void corrupt_version(uint64_t id, uint64_t version,
+			      const char *source);
+  void evict(object *obj);
   void maybe_evict_something(void);
-  
-  uint64_t max_in_memory_objects;
-  uint64_t current_in_memory_objects = 0;
-
-  //structs used in ss
-  //objects is a map from targets->objects (target == obj->id)
-  std::unordered_map<uint64_t, object *> objects;
-  std::set<object *, bool (*)(object *, object *)> lru_pqueue;
+  void update_footprint(object *obj);
+  void drop_footprint(object *obj);
+  bool over_budget(void) const;
+  bool internal_protected(void) const;
+
+  shard shards[SWAP_SPACE_SHARDS];
+  // Picks the shard for each new object, round-robin over the first
+  // used_shards.
+  std::atomic<uint64_t> next_alloc;
+  std::atomic<uint64_t> used_shards;
+
+  // Spare byte buffers, capacity intact, for encoded objects and the
+  // flusher's snapshots.
+  std::mutex buffer_lock;
+  std::vector<std::string> buffer_pool;
+
+  // The budgets are for the whole swap_space, and the counts kept
+  // against them are updated by every shard.
+  std::atomic<uint64_t> max_in_memory_objects;
+  std::atomic<uint64_t> current_in_memory_objects;
+  std::atomic<uint64_t> max_in_memory_bytes;
+  std::atomic<uint64_t> current_in_memory_bytes;
+  // Resident internal objects, and their share of the above.
+  double internal_share = 0;
+  std::atomic<uint64_t> current_internal_objects;
+  std::atomic<uint64_t> current_internal_bytes;
+  std::atomic<uint64_t> dirty_objects;
+
+  // Each shard's tier gets an even share of this, split over the
+  // shards in use.
+  std::atomic<uint64_t> max_tier_bytes;
+  std::atomic<uint64_t> tier_bytes;
+
+  std::thread flusher;
+  std::atomic<bool> flusher_running;
+  double dirty_watermark = 1.0;
+  unsigned flusher_interval_ms = 100;
+  // Protects flusher_stopping, and goes with flusher_wakeup, which
+  // wakes the flusher early.
+  std::mutex flusher_lock;
+  bool flusher_stopping = false;
+  std::condition_variable flusher_wakeup;
+  // Held by the flusher for each round, and by
+  // flushAllModifiedPagesIntoDisk() throughout, so that no write of
+  // the flusher's is in flight while it runs.
+  std::mutex flush_lock;
+  // The shard each flusher round starts with.
+  uint64_t flush_cursor = 0;
+
+  // Prefetching has its own lock, which is never held while taking a
+  // shard's, so loads can wait for a read already in flight.
+  enum prefetch_state { PREFETCH_QUEUED, PREFETCH_READING, PREFETCH_READY };
+  struct prefetch_entry {
+    prefetch_state state;
+    uint64_t version;
+    std::string raw;
+    uint8_t format;
+    // In prefetch_ready, once READY.
+    std::list<uint64_t>::iterator ready_pos;
+  };
+  typedef std::unordered_map<uint64_t, prefetch_entry>::iterator
+    prefetch_iterator;
+  std::mutex prefetch_lock;
+  std::unordered_map<uint64_t, prefetch_entry> prefetches;
+  std::deque<uint64_t> prefetch_queue;
+  // Ids of READY entries, oldest first.
+  std::list<uint64_t> prefetch_ready;
+  std::vector<std::thread> prefetchers;
+  bool prefetchers_stopping = false;
+  std::condition_variable prefetch_wakeup;
+  std::condition_variable prefetch_done;
+
+  void prefetch_erase(prefetch_iterator it);
 };
 
 #endif // SWAP_SPACE_HPP
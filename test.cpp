@@ -13,6 +13,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <memory>
 #include "betree.hpp"
 
 void timer_start(uint64_t &timer)
@@ -110,6 +111,21 @@ void usage(char *name)
     << "    -N <max_node_size>            (in elements)     [ default: " << DEFAULT_TEST_MAX_NODE_SIZE  << " ]" << std::endl
     << "    -f <min_flush_size>           (in elements)     [ default: " << DEFAULT_TEST_MIN_FLUSH_SIZE << " ]" << std::endl
     << "    -C <max_cache_size>           (in betree nodes) [ default: " << DEFAULT_TEST_CACHE_SIZE     << " ]" << std::endl
+    << "    -B <max_cache_bytes>          (0 is unlimited)  [ default: 0 ]"                                     << std::endl
+    << "    -T <compressed_cache_bytes>   (0 disables it)   [ default: 0 ]"                                     << std::endl
+    << "    -F <dirty_percent>            (background flusher watermark) [ default: no flusher ]"               << std::endl
+    << "    -R <prefetch_threads>                           [ default: 0 ]"                                     << std::endl
+    << "    -I <internal_percent>         (cache reserved for internal nodes) [ default: 0 ]"                   << std::endl
+    << "    -O                            (O_DIRECT node I/O) [ default: off ]"                                 << std::endl
+    << "    -z <node_codec>               (none, lz, zlib)  [ default: none ]"                                  << std::endl
+    << "    -S <node_format>              (text, binary, compact) [ default: text ]"                         << std::endl
+    << "    -P <eviction_policy>          (lru, clock, 2q, arc) [ default: lru ]"                               << std::endl
+    << "    -K                            (prefer clean eviction victims) [ default: off ]"                     << std::endl
+    << "    -H                            (read nodes stored without a header) [ default: off ]"                << std::endl
+    << "  Backing store options" << std::endl
+    << "    -M                            (keep nodes in RAM, no recovery) [ default: off ]"                    << std::endl
+    << "    -L <latency>                  (usecs per node I/O, with -M) [ default: 0 ]"                        << std::endl
+    << "    -W <bandwidth>                (bytes/sec, with -M) [ default: unlimited ]"                         << std::endl
     << "  Options for both tests and benchmarks" << std::endl
     << "    -k <number_of_distinct_keys>                    [ default: " << DEFAULT_TEST_NDISTINCT_KEYS << " ]" << std::endl
     << "    -t <number_of_operations>                       [ default: " << DEFAULT_TEST_NOPS           << " ]" << std::endl
@@ -276,6 +292,20 @@ int main(int argc, char **argv)
   char *script_infile = NULL;
   char *script_outfile = NULL;
   unsigned int random_seed = time(NULL) * getpid();
+  bool direct_io = false;
+  uint8_t codec = CODEC_NONE;
+  uint8_t node_format = SERIAL_TEXT;
+  bool in_memory = false;
+  std::string policy_name = "lru";
+  bool prefer_clean = false;
+  bool headerless = false;
+  uint64_t cache_bytes = 0;
+  uint64_t tier_bytes = 0;
+  int flusher_watermark = -1;
+  unsigned prefetch_threads = 0;
+  int internal_percent = 0;
+  uint64_t latency_us = 0;
+  uint64_t bytes_per_sec = 0;
  
   int opt;
   char *term;
@@ -284,7 +314,7 @@ int main(int argc, char **argv)
   // Argument parsing //
   //////////////////////
   
-  while ((opt = getopt(argc, argv, "m:d:N:f:C:o:k:t:s:i:")) != -1) {
+  while ((opt = getopt(argc, argv, "m:d:N:f:C:B:T:F:R:I:Oz:S:P:KHML:W:o:k:t:s:i:")) != -1) {
     switch (opt) {
     case 'm':
       mode = optarg;
@@ -316,6 +346,100 @@ int main(int argc, char **argv)
 	exit(1);
       }
       break;
+    case 'B':
+      cache_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -B must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'T':
+      tier_bytes = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -T must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'F':
+      flusher_watermark = strtol(optarg, &term, 10);
+      if (*term || flusher_watermark < 0 || flusher_watermark > 100) {
+	std::cerr << "Argument to -F must be a percentage" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'R':
+      prefetch_threads = strtoul(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -R must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'I':
+      internal_percent = strtol(optarg, &term, 10);
+      if (*term || internal_percent < 0 || internal_percent > 100) {
+	std::cerr << "Argument to -I must be a percentage" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'O':
+      direct_io = true;
+      break;
+    case 'z':
+      if (!parse_codec_name(optarg, codec)) {
+	std::cerr << "Unknown or unavailable codec '" << optarg << "'" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'S':
+      if (!parse_serialization_format_name(optarg, node_format)) {
+	std::cerr << "Unknown node format '" << optarg << "'" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'P':
+      policy_name = optarg;
+      {
+	eviction_policy *probe = make_eviction_policy(policy_name);
+	if (probe == NULL) {
+	  std::cerr << "Unknown eviction policy '" << optarg << "'" << std::endl;
+	  usage(argv[0]);
+	  exit(1);
+	}
+	delete probe;
+      }
+      break;
+    case 'K':
+      prefer_clean = true;
+      break;
+    case 'H':
+      headerless = true;
+      break;
+    case 'M':
+      in_memory = true;
+      break;
+    case 'L':
+      latency_us = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -L must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
+    case 'W':
+      bytes_per_sec = strtoull(optarg, &term, 10);
+      if (*term) {
+	std::cerr << "Argument to -W must be an integer" << std::endl;
+	usage(argv[0]);
+	exit(1);
+      }
+      break;
     case 'o':
       script_outfile = optarg;
       break;
@@ -406,8 +530,23 @@ int main(int argc, char **argv)
   // Construct a betree and run the tests or benchmarks //
   ////////////////////////////////////////////////////////
   
-  one_file_per_object_backing_store ofpobs(backing_store_dir);
-  swap_space sspace(&ofpobs, cache_size);
+  // Declared first, so that it outlives the tree and the swap_space.
+  std::unique_ptr<backing_store> bs;
+  if (in_memory)
+    bs.reset(new in_memory_backing_store(backing_store_dir, latency_us, bytes_per_sec));
+  else
+    bs.reset(new one_file_per_object_backing_store(backing_store_dir, direct_io));
+  swap_space sspace(bs.get(), cache_size, make_eviction_policy(policy_name));
+  sspace.set_compression(codec);
+  sspace.set_serialization_format(node_format);
+  sspace.set_prefer_clean_victims(prefer_clean);
+  sspace.set_headerless_nodes(headerless);
+  sspace.set_cache_bytes(cache_bytes);
+  sspace.set_compressed_cache_bytes(tier_bytes);
+  sspace.set_internal_share(internal_percent / 100.0);
+  if (flusher_watermark >= 0)
+    sspace.start_flusher(flusher_watermark / 100.0);
+  sspace.start_prefetchers(prefetch_threads);
   uint64_t persistence_granularity = 16;
   uint64_t checkpoint_granularity = 8;
   betree<uint64_t, std::string> b(&sspace, max_node_size, min_flush_size, \
@@ -419,6 +558,9 @@ int main(int argc, char **argv)
     benchmark_upserts(b, nops, number_of_distinct_keys, random_seed);
   else if (strcmp(mode, "benchmark-queries") == 0)
     benchmark_queries(b, nops, number_of_distinct_keys, random_seed);
+
+  bs->get_stats().print(std::cout, "node store");
+  b.log_io_stats().print(std::cout, "log");
   
   if (script_input)
     fclose(script_input);